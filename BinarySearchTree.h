@@ -12,12 +12,136 @@
 #include <cassert>  //assert
 #include <iostream> //ostream
 #include <functional> //less
+#include <algorithm> //max
+#include <cstddef> //size_t, max_align_t
+#include <new> //operator new, placement new
+#include <type_traits> //is_trivially_destructible
+#include <utility> //forward
 
 // You may add aditional libraries here if needed. You may use any
 // part of the STL except for containers.
 
+// NODE ALLOCATORS
+// A BinarySearchTree gets its Nodes from a Pool<Node> of its Allocator.
+// A Pool creates a Node from constructor arguments, and either frees
+// Nodes one at a time with destroy() (frees_in_bulk is false) or only
+// frees all of its Nodes at once with clear() (frees_in_bulk is true).
+// Each tree has its own Pool, which is never copied.
+
+// Allocates each Node on its own with new and frees it with delete.
+struct NewNodeAllocator {
+  template <typename Node>
+  class Pool {
+  public:
+    static constexpr bool frees_in_bulk = false;
+
+    template <typename... Args>
+    Node * create(Args&&... args) {
+      return new Node(std::forward<Args>(args)...);
+    }
+
+    void destroy(const Node *node) {
+      delete node;
+    }
+  };
+};
+
+// Allocates Nodes side by side in blocks that double in size up to
+// MAX_BLOCK_NODES Nodes, and frees a whole tree by freeing its blocks.
+// Nodes are only destroyed one by one when T has a destructor to run.
+struct ArenaNodeAllocator {
+  template <typename Node>
+  class Pool {
+  public:
+    static constexpr bool frees_in_bulk = true;
+
+    Pool()
+      : blocks(nullptr), next(nullptr), end(nullptr) { }
+
+    Pool(const Pool &) = delete;
+    Pool &operator=(const Pool &) = delete;
+
+    ~Pool() {
+      clear();
+    }
+
+    template <typename... Args>
+    Node * create(Args&&... args) {
+      if (next == end) {
+        add_block();
+      }
+      Node *node = new (next) Node(std::forward<Args>(args)...);
+      ++next;
+      return node;
+    }
+
+    // MODIFIES: this
+    // EFFECTS : Destroys every Node created by this Pool and frees
+    //           all of its blocks.
+    void clear() {
+      while (blocks) {
+        Block *block = blocks;
+        blocks = block->prev;
+        if (!std::is_trivially_destructible<Node>::value) {
+          Node *used_end = next ? next : nodes(block) + block->capacity;
+          for (Node *node = nodes(block); node != used_end; ++node) {
+            node->~Node();
+          }
+        }
+        next = nullptr;
+        ::operator delete(block);
+      }
+      next = end = nullptr;
+    }
+
+  private:
+    static constexpr size_t MIN_BLOCK_NODES = 32;
+    static constexpr size_t MAX_BLOCK_NODES = 8192;
+
+    static_assert(alignof(Node) <= alignof(std::max_align_t),
+                  "Nodes must not be over-aligned");
+
+    // A Block header is followed by storage for 'capacity' Nodes.
+    struct Block {
+      Block *prev;
+      size_t capacity;
+    };
+
+    static constexpr size_t HEADER_BYTES =
+      (sizeof(Block) + alignof(Node) - 1) / alignof(Node) * alignof(Node);
+
+    static Node * nodes(Block *block) {
+      return reinterpret_cast<Node *>(reinterpret_cast<char *>(block)
+                                      + HEADER_BYTES);
+    }
+
+    void add_block() {
+      size_t capacity = MIN_BLOCK_NODES;
+      if (blocks) {
+        capacity = blocks->capacity < MAX_BLOCK_NODES / 2
+                     ? 2 * blocks->capacity : MAX_BLOCK_NODES;
+      }
+      Block *block = static_cast<Block *>(
+        ::operator new(HEADER_BYTES + capacity * sizeof(Node)));
+      block->prev = blocks;
+      block->capacity = capacity;
+      blocks = block;
+      next = nodes(block);
+      end = next + capacity;
+    }
+
+    // The newest block, which Nodes are created in from 'next' to 'end'.
+    // Older blocks are full.
+    Block *blocks;
+    Node *next;
+    Node *end;
+  };
+};
+
 template <typename T,
-          typename Compare=std::less<T> // default if argument isn't provided
+          typename Compare=std::less<T>, // default if argument isn't provided
+          bool Balanced=false,
+          typename Allocator=NewNodeAllocator
          >
 class BinarySearchTree {
 
@@ -26,6 +150,15 @@ class BinarySearchTree {
   // between elements. The default is std::less<T>, which orders
   // according to the < operator on T. (For simplicity, we assume only
   // comparators that can be default constructed will be used.)
+  //
+  // If Balanced is true, the tree is kept balanced as an AVL tree: the
+  // heights of the two subtrees of every node differ by at most one, so
+  // the height of the tree is O(log n) whatever order elements are
+  // inserted in. Otherwise elements are inserted as leaves and the
+  // tree keeps whatever shape the insertion order gives it.
+  //
+  // Nodes are created and freed through a Pool of the Allocator, see
+  // NewNodeAllocator and ArenaNodeAllocator above.
 
   // INVARIANTS: All these invariants must hold for valid implementations
   // of BinarySearchTree. The invariants may also be considered as an implicit
@@ -55,27 +188,48 @@ class BinarySearchTree {
   // "greater than" end up meaning the same thing when duplicates are
   // not allowed.
 
-  // NOTE: Any operation you define must use RECURSION rather than iteration.
-  //       You may NOT use any looping constructs.
+  // NOTE: Operations whose depth of recursion would grow with the height of
+  // the tree (finding, inserting, copying, destroying, size and height)
+  // are written as loops that follow the child and parent links, so
+  // degenerate trees of any size do not overflow the stack.
 
 private:
 
-  // A Node stores an element and pointers to its left and right children
-  // DO NOT change this struct definition.
+  // A Node stores an element, pointers to its left and right children and
+  // to its parent, and the height of the subtree rooted at it
   struct Node {
 
     // Default constructor - does nothing
     Node() {}
 
-    // Custom constructor provided for convenience
+    // Custom constructor provided for convenience.  Makes the new Node the
+    // parent of its children, and gives it no parent.
     Node(const T &datum_in, Node *left_in, Node *right_in)
-            : datum(datum_in), left(left_in), right(right_in) { }
+            : datum(datum_in), left(left_in), right(right_in), parent(nullptr),
+              height(1 + std::max(node_height(left_in), node_height(right_in))) {
+      if (left) {
+        left->parent = this;
+      }
+      if (right) {
+        right->parent = this;
+      }
+    }
+
+    // Constructs a leaf under 'parent_in', its datum made from 'args'
+    template <typename... Args>
+    Node(Node *parent_in, Args&&... args)
+            : datum(std::forward<Args>(args)...), left(nullptr), right(nullptr),
+              parent(parent_in), height(1) { }
 
     T datum;
     Node *left;
     Node *right;
+    Node *parent;
+    int height;
   };
 
+  using Pool = typename Allocator::template Pool<Node>;
+
 public:
 
   // Default constructor
@@ -85,21 +239,21 @@ public:
 
   // Copy constructor
   BinarySearchTree(const BinarySearchTree &other)
-    : root(copy_nodes_impl(other.root)) { }
+    : root(copy_nodes_impl(other.root, pool)) { }
 
   // Assignment operator
   BinarySearchTree &operator=(const BinarySearchTree &rhs) {
     if (this == &rhs) {
       return *this;
     }
-    destroy_nodes_impl(root);
-    root = copy_nodes_impl(rhs.root);
+    destroy_nodes();
+    root = copy_nodes_impl(rhs.root, pool);
     return *this;
   }
 
   // Destructor
   ~BinarySearchTree() {
-    destroy_nodes_impl(root);
+    destroy_nodes();
   }
 
   // EFFECTS: Returns whether this BinarySearchTree is empty.
@@ -148,9 +302,13 @@ public:
 
     // Big Three for Iterator not needed
 
+    // An Iterator is a single Node pointer. Nodes link to their parents,
+    // so stepping to the next element never searches from the root, and
+    // a traversal of the whole tree follows each link at most twice.
+
   public:
     Iterator()
-      : root(nullptr), current_node(nullptr) {}
+      : current_node(nullptr) {}
 
     // EFFECTS:  Returns the current element by reference.
     // WARNING:  Dereferencing an iterator returns an element from the tree
@@ -187,8 +345,14 @@ public:
         current_node = min_element_impl(current_node->right);
       }
       else {
-        // Otherwise, look in the whole tree for the next biggest element
-        current_node = min_greater_than_impl(root, current_node->datum, less);
+        // Otherwise, the next element is the first ancestor that has the
+        // current node in its left subtree
+        Node *child = current_node;
+        current_node = current_node->parent;
+        while (current_node && child == current_node->right) {
+          child = current_node;
+          current_node = current_node->parent;
+        }
       }
       return *this;
     }
@@ -211,12 +375,10 @@ public:
   private:
     friend class BinarySearchTree;
 
-    Node *root;
     Node *current_node;
-    Compare less;
 
-    Iterator(Node *root_in, Node* current_node_in, Compare less_in)
-      : root(root_in), current_node(current_node_in), less(less_in) { }
+    Iterator(Node* current_node_in)
+      : current_node(current_node_in) { }
 
   }; // BinarySearchTree::Iterator
   ////////////////////////////////////////
@@ -228,7 +390,7 @@ public:
     if (root == nullptr) {
       return Iterator();
     }
-    return Iterator(root, min_element_impl(root), less);
+    return Iterator(min_element_impl(root));
   }
 
   // EFFECTS: Returns an iterator to past-the-end.
@@ -240,20 +402,20 @@ public:
   // EFFECTS: Returns an Iterator to the minimum element in this
   //          BinarySearchTree or an end Iterator if the tree is empty.
   Iterator min_element() const {
-    return Iterator(root, min_element_impl(root), less);
+    return Iterator(min_element_impl(root));
   }
 
   // EFFECTS: Returns an Iterator to the maximum element in this
   //          BinarySearchTree or an end Iterator if the tree is empty.
   Iterator max_element() const {
-    return Iterator(root, max_element_impl(root), less);
+    return Iterator(max_element_impl(root));
   }
 
   // EFFECTS: Returns an Iterator to the minimum element in this
   //          BinarySearchTree greater than the given value.
   //          If the tree is empty, returns an end Iterator.
   Iterator min_greater_than(const T &value) const {
-    return Iterator(root, min_greater_than_impl(root, value, less), less);
+    return Iterator(min_greater_than_impl(root, value, less));
   }
 
 
@@ -267,7 +429,7 @@ public:
   //          to the existing value. Otherwise, the sorting invariant
   //          will no longer hold.
   Iterator find(const T &query) const {
-    return Iterator(root, find_impl(root, query, less), less);
+    return Iterator(find_impl(root, query, less));
   }
 
   // REQUIRES: The given item is not already contained in this BinarySearchTree
@@ -275,9 +437,29 @@ public:
   // EFFECTS : Inserts the element k into this BinarySearchTree, maintaining
   //           the sorting invariant.
   Iterator insert(const T &item) {
-    assert(find(item) == end());
-    root = insert_impl(root, item, less);
-    return find(item);
+    bool inserted = false;
+    Node *node = emplace_impl(root, inserted, item, less, pool, item);
+    assert(inserted);
+    return Iterator(node);
+  }
+
+  // MODIFIES: this BinarySearchTree
+  // EFFECTS : If an element equivalent to 'query' is contained in this
+  //           BinarySearchTree, returns an Iterator to it along with the
+  //           value false. Otherwise, inserts an element constructed
+  //           from 'args', which must be equivalent to 'query', and
+  //           returns an Iterator to it along with the value true.
+  // NOTE:     Descends the tree once, where a find() followed by an
+  //           insert() would descend it three times.
+  // NOTE:     'query' need not be a T, as long as Compare can order it
+  //           against a T in both argument positions. A T is then only
+  //           constructed when one is inserted.
+  template <typename Query, typename... Args>
+  std::pair<Iterator, bool> find_or_emplace(const Query &query, Args&&... args) {
+    bool inserted = false;
+    Node *node = emplace_impl(root, inserted, query, less, pool,
+                              std::forward<Args>(args)...);
+    return std::pair<Iterator, bool>{Iterator(node), inserted};
   }
 
   // EFFECTS: Returns a human-readable string representation of this
@@ -291,6 +473,10 @@ public:
 private:
 
   // DATA REPRESENTATION
+  // The Pool that the Nodes of this BinarySearchTree come from. It is
+  // declared before root so the copy constructor can copy into it.
+  Pool pool;
+
   // The root node of this BinarySearchTree.
   Node *root;
 
@@ -330,48 +516,117 @@ private:
   // EFFECTS: Returns the size of the tree rooted at 'node', which is the
   //          total number of nodes in that tree. The size of an empty
   //          tree is 0.
-  // NOTE:    This function must be tree recursive.
+  // NOTE:    This function visits the nodes in post-order without recursion.
   static int size_impl(const Node *node) {
-    if (!node) {                                       
+    if (!node) {
       return 0;
-    } else {                                             
-      return 1 + size_impl(node->left) + size_impl(node->right);
     }
+    int size = 0;
+    for (const Node *current = first_postorder_impl(node); current;
+         current = next_postorder_impl(current, node)) {
+      ++size;
+    }
+    return size;
   }
 
   // EFFECTS: Returns the height of the tree rooted at 'node', which is the
   //          number of nodes in the longest path from the 'node' to a leaf.
   //          The height of an empty tree is 0.
-  // NOTE:    This function must be tree recursive.
+  // NOTE:    This function runs in constant time, since every Node keeps
+  //          the height of the subtree rooted at it.
   static int height_impl(const Node *node) {
-    if (!node) {
-      return 0;
-    } else {
-      return 1 + std::max(height_impl(node->left), height_impl(node->right));
-    }
+    return node_height(node);
   }
 
   // EFFECTS: Creates and returns a pointer to the root of a new node structure
   //          with the same elements and EXACTLY the same structure as the
   //          tree rooted at 'node'.
-  // NOTE:    This function must be tree recursive.
-  static Node *copy_nodes_impl(Node *node) {
+  // NOTE:    This function walks both trees together without recursion,
+  //          going down to copy a missing child and up through the parent
+  //          links once both children of a node have been copied.
+  static Node *copy_nodes_impl(Node *node, Pool &pool) {
     if (!node) {
       return nullptr;
-    } else {  
-      return new Node(node->datum, copy_nodes_impl(node->left), copy_nodes_impl(node->right));  
+    }
+    Node *root = pool.create(node->datum, nullptr, nullptr);
+    root->height = node->height;
+    const Node *from = node;
+    Node *to = root;
+    while (true) {
+      if (from->left && !to->left) {
+        from = from->left;
+        to->left = pool.create(from->datum, nullptr, nullptr);
+        to->left->parent = to;
+        to = to->left;
+      } else if (from->right && !to->right) {
+        from = from->right;
+        to->right = pool.create(from->datum, nullptr, nullptr);
+        to->right->parent = to;
+        to = to->right;
+      } else if (from == node) {
+        return root;
+      } else {
+        from = from->parent;
+        to = to->parent;
+        continue;
+      }
+      to->height = from->height;
     }
   }
 
   // EFFECTS: Frees the memory for all nodes used in the tree rooted at 'node'.
-  // NOTE:    This function must be tree recursive.
-  static void destroy_nodes_impl(Node *node) {
-    if (node) {
-      destroy_nodes_impl(node->left); 
-      destroy_nodes_impl(node->right);
-      delete node;    
+  // NOTE:    This function frees the nodes in post-order without recursion,
+  //          so each Node is freed after its children.
+  static void destroy_nodes_impl(Node *node, Pool &pool) {
+    if (!node) {
+      return;
+    }
+    const Node *current = first_postorder_impl(node);
+    while (current) {
+      const Node *next = next_postorder_impl(current, node);
+      pool.destroy(current);
+      current = next;
     }
-  } 
+  }
+
+  // MODIFIES: this
+  // EFFECTS : Frees all nodes in this tree and makes it empty. If the
+  //           Pool frees in bulk, the tree is not walked at all.
+  void destroy_nodes() {
+    if constexpr (Pool::frees_in_bulk) {
+      pool.clear();
+    } else {
+      destroy_nodes_impl(root, pool);
+    }
+    root = nullptr;
+  }
+
+  // REQUIRES: 'node' is not null
+  // EFFECTS : Returns the Node visited first by a post-order traversal of
+  //           the tree rooted at 'node', which is its leftmost leaf.
+  static const Node * first_postorder_impl(const Node *node) {
+    while (node->left || node->right) {
+      node = node->left ? node->left : node->right;
+    }
+    return node;
+  }
+
+  // REQUIRES: 'node' is in the tree rooted at 'root'
+  // EFFECTS : Returns the Node visited after 'node' by a post-order
+  //           traversal of the tree rooted at 'root', or a null pointer
+  //           if 'node' is 'root'.
+  // NOTE: Never reads 'node' or its descendants after 'node->parent',
+  //       so the caller may free 'node' once it has the result.
+  static const Node * next_postorder_impl(const Node *node, const Node *root) {
+    if (node == root) {
+      return nullptr;
+    }
+    const Node *parent = node->parent;
+    if (node == parent->left && parent->right) {
+      return first_postorder_impl(parent->right);
+    }
+    return parent;
+  }
 
 
   // EFFECTS : Searches the tree rooted at 'node' for an element equivalent
@@ -379,82 +634,174 @@ private:
   //           containing it. If the tree is empty or the element is not
   //           found, returns a null pointer.
   //
-  // NOTE: This function must be tail recursive.
-  // HINT: Equivalence is defined according to the Compare functor
+  // NOTE: Equivalence is defined according to the Compare functor
   //       associated with this instantiation of the BinarySearchTree
   //       template, NOT according to the == operator. Use the "less"
   //       parameter to compare elements.
   //       Two elements A and B are equivalent if and only if A is
   //       not less than B and B is not less than A.
   static Node * find_impl(Node *node, const T &query, Compare less) {
-    if (!node) {
-      return nullptr;
-    } else if (less(query, node->datum)){
-      return find_impl(node->left, query, less);
-    } else if(less(node->datum, query)) {
-      return find_impl(node->right, query, less);
-    } else {
-      return node;
-    } 
+    while (node) {
+      if (less(query, node->datum)) {
+        node = node->left;
+      } else if (less(node->datum, query)) {
+        node = node->right;
+      } else {
+        return node;
+      }
+    }
+    return nullptr;
   }
 
-  // REQUIRES: item is not already contained in the tree rooted at 'node'
-  // MODIFIES: the tree rooted at 'node'
-  // EFFECTS : If 'node' represents an empty tree, allocates a new
-  //           Node to represent a single-element tree with 'item' as
-  //           its only element and returns a pointer to the new Node.
-  //           If the tree rooted at 'node' is not empty, inserts
-  //           'item' into the proper location as a leaf in the
-  //           existing tree structure according to the sorting
-  //           invariant and returns the original parameter 'node'.
-  // NOTE: This function must be linear recursive, but does not
-  //       need to be tail recursive.
-  // HINT: Element ordering is defined according to the Compare functor
+  // MODIFIES: the tree rooted at 'node', inserted
+  // EFFECTS : Searches the tree rooted at 'node' for an element equivalent
+  //           to 'query'. If one is found, sets 'inserted' to false and
+  //           returns a pointer to the node containing it. Otherwise,
+  //           links a new leaf whose element is constructed from 'args'
+  //           where the search ended, sets 'inserted' to true and returns
+  //           a pointer to the new leaf. The element made from 'args'
+  //           must be equivalent to 'query'.
+  // NOTE: Element ordering is defined according to the Compare functor
   //       associated with this instantiation of the BinarySearchTree
   //       template, NOT according to the < operator. Use the "less"
   //       parameter to compare elements.
-  static Node * insert_impl(Node *node, const T &item, Compare less) {
-    if (!node) {
-      return new Node(item, nullptr, nullptr);
-    } else if (less(item, node->datum)) {
-      node->left = insert_impl(node->left, item, less);
-      return node;
-    } else {
-      node->right = insert_impl(node->right, item, less);
+  // NOTE: The ancestors of the new leaf are rebalanced on the way back up
+  //       through the parent links, so if Balanced 'node' may be set to
+  //       a different Node. The climb stops at the first ancestor whose
+  //       height and shape are unchanged.
+  template <typename Query, typename... Args>
+  static Node * emplace_impl(Node *&node, bool &inserted, const Query &query,
+                             Compare less, Pool &pool, Args&&... args) {
+    Node *const above = node ? node->parent : nullptr;
+    Node *parent = nullptr;
+    Node **link = &node;
+    while (*link) {
+      parent = *link;
+      if (less(query, parent->datum)) {
+        link = &parent->left;
+      } else if (less(parent->datum, query)) {
+        link = &parent->right;
+      } else {
+        inserted = false;
+        return parent;
+      }
+    }
+    Node *leaf = pool.create(parent, std::forward<Args>(args)...);
+    *link = leaf;
+    inserted = true;
+
+    while (parent != above) {
+      Node *grandparent = parent->parent;
+      const int old_height = parent->height;
+      Node *subtree = rebalance_impl(parent);
+      if (subtree == parent && subtree->height == old_height) {
+        break;
+      }
+      if (grandparent == above) {
+        node = subtree;
+      } else if (grandparent->left == parent) {
+        grandparent->left = subtree;
+      } else {
+        grandparent->right = subtree;
+      }
+      parent = grandparent;
+    }
+    return leaf;
+  }
+
+  // EFFECTS : Returns the height stored in 'node', or 0 if it is null.
+  static int node_height(const Node *node) {
+    return node ? node->height : 0;
+  }
+
+  // MODIFIES: node
+  // EFFECTS : Sets the height of 'node' from the heights of its children.
+  static void update_height(Node *node) {
+    node->height = 1 + std::max(node_height(node->left), node_height(node->right));
+  }
+
+  // REQUIRES: node->right is not null
+  // MODIFIES: the tree rooted at 'node'
+  // EFFECTS : Rotates the tree rooted at 'node' to the left, so that its
+  //           right child becomes its root, and returns the new root.
+  //           The new root takes the parent of 'node'.
+  static Node * rotate_left(Node *node) {
+    Node *right = node->right;
+    node->right = right->left;
+    if (node->right) {
+      node->right->parent = node;
+    }
+    right->left = node;
+    right->parent = node->parent;
+    node->parent = right;
+    update_height(node);
+    update_height(right);
+    return right;
+  }
+
+  // REQUIRES: node->left is not null
+  // MODIFIES: the tree rooted at 'node'
+  // EFFECTS : Rotates the tree rooted at 'node' to the right, so that its
+  //           left child becomes its root, and returns the new root.
+  //           The new root takes the parent of 'node'.
+  static Node * rotate_right(Node *node) {
+    Node *left = node->left;
+    node->left = left->right;
+    if (node->left) {
+      node->left->parent = node;
+    }
+    left->right = node;
+    left->parent = node->parent;
+    node->parent = left;
+    update_height(left->right);
+    update_height(left);
+    return left;
+  }
+
+  // REQUIRES: the subtrees of 'node' are balanced, and their heights
+  //           differ by at most two
+  // MODIFIES: the tree rooted at 'node'
+  // EFFECTS : Updates the height of 'node'. If Balanced, rotates the tree
+  //           rooted at 'node' so that the heights of its subtrees differ
+  //           by at most one. Returns the root of the tree.
+  static Node * rebalance_impl(Node *node) {
+    update_height(node);
+    if (!Balanced) {
       return node;
-    }  
+    }
+    const int balance = node_height(node->left) - node_height(node->right);
+    if (balance > 1) {
+      if (node_height(node->left->left) < node_height(node->left->right)) {
+        node->left = rotate_left(node->left);
+      }
+      return rotate_right(node);
+    } else if (balance < -1) {
+      if (node_height(node->right->right) < node_height(node->right->left)) {
+        node->right = rotate_right(node->right);
+      }
+      return rotate_left(node);
+    }
+    return node;
   }
 
   // EFFECTS : Returns a pointer to the Node containing the minimum element
   //           in the tree rooted at 'node' or a null pointer if the tree is empty.
-  // NOTE: This function must be tail recursive.
   // NOTE: This function is used in the implementation of the ++ operator for
-  //       the iterator code that is provided for you.
-  // HINT: You don't need to compare any elements! Think about the
-  //       structure, and where the smallest element lives.
+  //       the iterator code.
   static Node * min_element_impl(Node *node) {
-    if (!node) {
-      return nullptr;
-    } else if (!node->left) {
-      return node; 
-    } else {
-      return min_element_impl(node->left);
+    while (node && node->left) {
+      node = node->left;
     }
+    return node;
   }
 
   // EFFECTS : Returns a pointer to the Node containing the maximum element
   //           in the tree rooted at 'node' or a null pointer if the tree is empty.
-  // NOTE: This function must be tail recursive.
-  // HINT: You don't need to compare any elements! Think about the
-  //       structure, and where the largest element lives.
   static Node * max_element_impl(Node *node) {
-    if (!node) {
-      return nullptr;
-    } else if (!node->right) {
-      return node; 
-    } else {
-      return max_element_impl(node->right);
+    while (node && node->right) {
+      node = node->right;
     }
+    return node;
   }
 
 
@@ -515,8 +862,6 @@ private:
   //           contain any elements that are greater than 'val'.
   //
   // NOTE: This function must be linear recursive.
-  // NOTE: This function is used in the implementation of the ++ operator for
-  //       the iterator code that is provided for you.
   // HINT: At each step, compare 'val' and the current node (using the
   //       'less' parameter). Based on the result, you gain some information
   //       about where the element you're looking for could be.
@@ -556,9 +901,10 @@ private:
 //           BinarySearchTree Iterator, which in turn depends on some
 //           of the functions you must write.
 
-template <typename T, typename Compare>
+template <typename T, typename Compare, bool Balanced, typename Allocator>
 std::ostream &operator<<(std::ostream &os,
-                         const BinarySearchTree<T, Compare> &tree) {
+                         const BinarySearchTree<T, Compare, Balanced,
+                                                Allocator> &tree) {
 // DO NOT CHANGE THE IMPLEMENTATION OF THIS FUNCTION
   os << "[ ";
   for (T& elt : tree) {
@@ -2,6 +2,9 @@
 #include "unit_test_framework.h"
 #include <sstream>
 #include <string>
+#include <exception>
+#include <functional>
+#include <pthread.h>
 
 
 TEST(test_bst_ctor) {
@@ -73,6 +76,9 @@ TEST(test_iterator_increment_operator) {
 
     auto b_it = b.begin();
     ASSERT_EQUAL(++*b_it, 2);
+    // Incrementing follows the tree structure, not the modified value
+    b_it++;
+    ASSERT_EQUAL(*b_it, 2);
     b_it++;
     ASSERT_EQUAL(*b_it, 3);    
 }
@@ -208,4 +214,227 @@ TEST(test_bst_insertion_operator) {
     ASSERT_EQUAL(correct_output, output.str());
 }
 
+TEST(test_bst_balanced_sorted_insert) {
+    BinarySearchTree<int, std::less<int>, true> b;
+    for (int i = 0; i < 1000; ++i) {
+        b.insert(i);
+    }
+    ASSERT_EQUAL(b.size(), 1000u);
+    // Sorted insertion into an AVL tree builds a near-perfect tree, so the
+    // height is the least possible for 1000 elements, ceil(log2(1001)).
+    ASSERT_EQUAL(b.height(), 10u);
+    ASSERT_TRUE(b.check_sorting_invariant());
+
+    int expected = 0;
+    for (int elt : b) {
+        ASSERT_EQUAL(elt, expected++);
+    }
+    ASSERT_EQUAL(expected, 1000);
+}
+
+TEST(test_bst_balanced_rotations) {
+    BinarySearchTree<int, std::less<int>, true> b;
+    b.insert(3);
+    b.insert(1);
+    b.insert(2); // left-right case
+
+    std::ostringstream output;
+    b.traverse_preorder(output);
+    ASSERT_EQUAL(output.str(), "2 1 3 ");
+    ASSERT_EQUAL(b.height(), 2u);
+
+    BinarySearchTree<int, std::less<int>, true> b2;
+    b2.insert(1);
+    b2.insert(3);
+    b2.insert(2); // right-left case
+    ASSERT_EQUAL(b2.height(), 2u);
+    ASSERT_EQUAL(*b2.find(2), 2);
+    ASSERT_EQUAL(*b2.min_greater_than(2), 3);
+}
+
+TEST(test_bst_unbalanced_keeps_shape) {
+    BinarySearchTree<int> b;
+    b.insert(1);
+    b.insert(2);
+    b.insert(3);
+    ASSERT_EQUAL(b.height(), 3u);
+}
+
+TEST(test_bst_iterator_parent_links) {
+    ASSERT_EQUAL(sizeof(BinarySearchTree<int>::Iterator), sizeof(void *));
+
+    // Descending inserts leave every node without a right child, so each
+    // step climbs back through a parent link
+    BinarySearchTree<int> b;
+    for (int i = 2000; i > 0; --i) {
+        b.insert(i);
+    }
+    int expected = 1;
+    for (int elt : b) {
+        ASSERT_EQUAL(elt, expected++);
+    }
+    ASSERT_EQUAL(expected, 2001);
+
+    BinarySearchTree<int, std::less<int>, true> balanced;
+    for (int i = 0; i < 500; ++i) {
+        balanced.insert((i * 37) % 500);
+    }
+    BinarySearchTree<int, std::less<int>, true> copy(balanced);
+    expected = 0;
+    for (int elt : copy) {
+        ASSERT_EQUAL(elt, expected++);
+    }
+    ASSERT_EQUAL(expected, 500);
+    auto it = copy.find(250);
+    ++it;
+    ASSERT_EQUAL(*it, 251);
+}
+
+// EFFECTS: Runs body on a thread with a stack of stack_size bytes, and
+// rethrows anything it throws, such as a failed assertion.
+static void run_with_stack(size_t stack_size, const std::function<void()> &body) {
+    struct Call {
+        const std::function<void()> *body;
+        std::exception_ptr error;
+    } call{&body, nullptr};
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, stack_size);
+    pthread_t thread;
+    const int created = pthread_create(&thread, &attr, [](void *arg) -> void * {
+        Call *call = static_cast<Call *>(arg);
+        try {
+            (*call->body)();
+        } catch (...) {
+            call->error = std::current_exception();
+        }
+        return nullptr;
+    }, &call);
+    pthread_attr_destroy(&attr);
+    ASSERT_EQUAL(created, 0);
+    pthread_join(thread, nullptr);
+    if (call.error) {
+        std::rethrow_exception(call.error);
+    }
+}
+
+TEST(test_bst_degenerate_tree) {
+    // Building a chain takes time quadratic in its length, so instead of a
+    // chain long enough to overflow the usual stack, 10000 node chains are
+    // used on a 64 KiB stack.  Recursing once per node overflows it.
+    run_with_stack(64 * 1024, [] {
+        // Every insert goes to the right, so the tree is a 10000 node chain
+        BinarySearchTree<int> b;
+        for (int i = 0; i < 10000; ++i) {
+            b.insert(i);
+        }
+        ASSERT_EQUAL(b.size(), 10000u);
+        ASSERT_EQUAL(b.height(), 10000u);
+        ASSERT_EQUAL(*b.find(9999), 9999);
+        ASSERT_TRUE(b.find(10000) == b.end());
+
+        BinarySearchTree<int> copy(b);
+        ASSERT_EQUAL(copy.size(), 10000u);
+        ASSERT_EQUAL(copy.height(), 10000u);
+        int expected = 0;
+        for (int elt : copy) {
+            ASSERT_EQUAL(elt, expected++);
+        }
+        ASSERT_EQUAL(expected, 10000);
+
+        copy = BinarySearchTree<int>();
+        ASSERT_TRUE(copy.empty());
+
+        // Every insert goes to the left, so the tree is a chain the other way
+        BinarySearchTree<int> left;
+        for (int i = 10000; i > 0; --i) {
+            left.insert(i);
+        }
+        ASSERT_EQUAL(left.size(), 10000u);
+        ASSERT_EQUAL(left.height(), 10000u);
+        ASSERT_EQUAL(*left.min_element(), 1);
+        BinarySearchTree<int> left_copy(left);
+        ASSERT_EQUAL(left_copy.size(), 10000u);
+    });
+}
+
+TEST(test_bst_copy_keeps_shape) {
+    BinarySearchTree<int> b;
+    int elts[] = { 50, 30, 70, 20, 40, 60, 80, 35, 45, 65 };
+    for (int elt : elts) {
+        b.insert(elt);
+    }
+    BinarySearchTree<int> copy(b);
+
+    std::ostringstream b_output;
+    std::ostringstream copy_output;
+    b.traverse_preorder(b_output);
+    copy.traverse_preorder(copy_output);
+    ASSERT_EQUAL(b_output.str(), copy_output.str());
+    ASSERT_EQUAL(b.to_string(), copy.to_string());
+    ASSERT_EQUAL(copy.height(), 4u);
+    ASSERT_EQUAL(copy.size(), 10u);
+
+    copy.insert(36);
+    ASSERT_EQUAL(copy.height(), 5u);
+    ASSERT_EQUAL(b.height(), 4u);
+    ASSERT_TRUE(copy.check_sorting_invariant());
+}
+
+TEST(test_bst_arena_allocator) {
+    BinarySearchTree<std::string, std::less<std::string>, true,
+                     ArenaNodeAllocator> b;
+    for (int i = 0; i < 10000; ++i) {
+        b.insert(std::to_string(i));
+    }
+    ASSERT_EQUAL(b.size(), 10000u);
+    ASSERT_EQUAL(*b.begin(), "0");
+    ASSERT_EQUAL(*b.find("9999"), "9999");
+
+    BinarySearchTree<std::string, std::less<std::string>, true,
+                     ArenaNodeAllocator> copy(b);
+    ASSERT_EQUAL(copy.size(), 10000u);
+    ASSERT_EQUAL(copy.to_string().empty(), false);
+
+    copy = BinarySearchTree<std::string, std::less<std::string>, true,
+                            ArenaNodeAllocator>();
+    ASSERT_TRUE(copy.empty());
+    copy.insert("a");
+    copy = b;
+    ASSERT_EQUAL(copy.size(), 10000u);
+    ASSERT_TRUE(copy.find("a") == copy.end());
+
+    std::ostringstream b_output;
+    std::ostringstream copy_output;
+    b_output << b;
+    copy_output << copy;
+    ASSERT_EQUAL(b_output.str(), copy_output.str());
+}
+
+TEST(test_bst_find_or_emplace) {
+    BinarySearchTree<int, std::less<int>, true> b;
+    b.insert(5);
+    b.insert(3);
+
+    auto result = b.find_or_emplace(3, 3);
+    ASSERT_FALSE(result.second);
+    ASSERT_TRUE(result.first == b.find(3));
+    ASSERT_EQUAL(b.size(), 2u);
+
+    for (int i = 10; i > 5; --i) { // rotations while linking
+        result = b.find_or_emplace(i, i);
+        ASSERT_TRUE(result.second);
+        ASSERT_EQUAL(*result.first, i);
+    }
+    ASSERT_EQUAL(b.size(), 7u);
+    ASSERT_EQUAL(b.height(), 4u);
+    ASSERT_TRUE(b.check_sorting_invariant());
+
+    BinarySearchTree<std::string> strings;
+    auto emplaced = strings.find_or_emplace("ccc", 3, 'c');
+    ASSERT_TRUE(emplaced.second);
+    ASSERT_EQUAL(*emplaced.first, "ccc");
+    ASSERT_FALSE(strings.find_or_emplace("ccc", 3, 'c').second);
+}
+
 TEST_MAIN()
@@ -0,0 +1,119 @@
+#define CLASSIFIER_NO_MAIN
+#include "main.cpp"
+#include "unit_test_framework.h"
+#include <cstdio>
+
+
+// MODIFIES: classifier
+// EFFECTS: Trains classifier on the posts of a CSV file held in csv, without
+// printing the training summary.
+static void train_on(Classifier &classifier, const string &csv) {
+    istringstream in(csv);
+    csvstream train_csv(in);
+    ostringstream summary;
+    streambuf *cout_buf = cout.rdbuf(summary.rdbuf());
+    classifier.train(train_csv);
+    cout.rdbuf(cout_buf);
+}
+
+// MODIFIES: classifier
+// EFFECTS: Loads the model in filename into classifier, without printing the
+// training summary.
+static void load_quietly(Classifier &classifier, const string &filename) {
+    ostringstream summary;
+    streambuf *cout_buf = cout.rdbuf(summary.rdbuf());
+    classifier.load_model(filename);
+    cout.rdbuf(cout_buf);
+}
+
+// EFFECTS: Asserts that online and frozen predict the same label and score
+// for content.
+static void assert_same_prediction(Classifier &online, Classifier &frozen, const string &content) {
+    double online_score = 0;
+    double frozen_score = 0;
+    const string online_label = online.predict(content, online_score);
+    const string frozen_label = frozen.predict(content, frozen_score);
+    ASSERT_EQUAL(online_label, frozen_label);
+    ASSERT_ALMOST_EQUAL(online_score, frozen_score, 1e-12);
+}
+
+const string TRAIN_HEADER = "tag,content\n";
+const string TRAIN_POSTS = "euchre,the trump suit is hearts\n"
+                           "calculator,how do i use the calculator\n"
+                           "euchre,who called trump in the last hand\n";
+
+
+TEST(test_classifier_observe) {
+    Classifier online(false);
+    train_on(online, TRAIN_HEADER + TRAIN_POSTS);
+    online.observe("calculator", "my calculator shows the wrong answer");
+    online.observe("recursion", "the base case is missing");
+
+    Classifier frozen(false);
+    train_on(frozen, TRAIN_HEADER + TRAIN_POSTS
+                     + "calculator,my calculator shows the wrong answer\n"
+                     + "recursion,the base case is missing\n");
+    assert_same_prediction(online, frozen, "trump hearts");
+    assert_same_prediction(online, frozen, "the calculator answer");
+    assert_same_prediction(online, frozen, "base case base case");
+    assert_same_prediction(online, frozen, "words never seen");
+}
+
+TEST(test_classifier_observe_batch) {
+    Classifier online(false);
+    train_on(online, TRAIN_HEADER + TRAIN_POSTS);
+    online.observe_batch({{"recursion", "the base case is missing"},
+                          {"euchre", "left bower is trump"}});
+
+    Classifier frozen(false);
+    train_on(frozen, TRAIN_HEADER + TRAIN_POSTS
+                     + "recursion,the base case is missing\n"
+                     + "euchre,left bower is trump\n");
+    assert_same_prediction(online, frozen, "who has the left bower");
+    assert_same_prediction(online, frozen, "missing case");
+    assert_same_prediction(online, frozen, "");
+}
+
+TEST(test_classifier_observe_untrained) {
+    Classifier online(false);
+    double score = 1;
+    ASSERT_EQUAL(online.predict("anything", score), "");
+    ASSERT_EQUAL(score, 0.0);
+
+    online.observe("a", "x y");
+    online.observe("b", "y z");
+    Classifier frozen(false);
+    train_on(frozen, TRAIN_HEADER + "a,x y\nb,y z\n");
+    assert_same_prediction(online, frozen, "x");
+    assert_same_prediction(online, frozen, "z y");
+}
+
+TEST(test_classifier_load_then_observe) {
+    const string model_file = "Classifier_tests.model";
+
+    // "p" and "q" tie on "w", and ties go to "q".  The labels are seen in
+    // the opposite order to the one the loaded model has them in.
+    Classifier tied(false);
+    train_on(tied, TRAIN_HEADER + "q,w\np,w\n");
+    tied.save_model(model_file);
+
+    Classifier reused(false);
+    train_on(reused, TRAIN_HEADER + "q,v\np,v\n");
+    reused.observe("q", "v");
+    load_quietly(reused, model_file);
+    reused.observe_batch({});
+    remove(model_file.c_str());
+
+    Classifier fresh(false);
+    train_on(fresh, TRAIN_HEADER + "q,w\np,w\n");
+    double score = 0;
+    ASSERT_EQUAL(reused.predict("w", score), "q");
+    assert_same_prediction(reused, fresh, "w");
+
+    reused.observe("p", "w");
+    train_on(fresh, TRAIN_HEADER + "p,w\n");
+    ASSERT_EQUAL(reused.predict("w", score), "p");
+    assert_same_prediction(reused, fresh, "w");
+}
+
+TEST_MAIN()
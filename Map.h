@@ -9,10 +9,12 @@
 
 #include "BinarySearchTree.h"
 #include <cassert>  //assert
-#include <utility>  //pair
+#include <tuple>    //forward_as_tuple
+#include <utility>  //pair, piecewise_construct, forward
 
 template <typename Key_type, typename Value_type,
-          typename Key_compare=std::less<Key_type> // default argument
+          typename Key_compare=std::less<Key_type>, // default argument
+          typename Allocator=ArenaNodeAllocator
          >
 class Map {
 
@@ -22,17 +24,31 @@ private:
   // See http://www.cplusplus.com/reference/utility/pair/
   using Pair_type = std::pair<Key_type, Value_type>;
 
-  // A custom comparator
+  // A custom comparator. It also orders a bare key against a pair, so
+  // that a key can be looked up without first building a pair around it.
   class PairComp {
     public:
       bool operator ()(const Pair_type &lhs, const Pair_type &rhs) const {
         return less(lhs.first, rhs.first);
       }
+
+      bool operator ()(const Key_type &lhs, const Pair_type &rhs) const {
+        return less(lhs, rhs.first);
+      }
+
+      bool operator ()(const Pair_type &lhs, const Key_type &rhs) const {
+        return less(lhs.first, rhs);
+      }
    
     private:
       Key_compare less;  
   };
 
+  // The tree is balanced, so that keys inserted in sorted order do not
+  // make lookups linear. A Map never removes single elements, so by
+  // default its nodes come from an arena and are freed all at once.
+  using Tree_type = BinarySearchTree<Pair_type, PairComp, true, Allocator>;
+
 public:
 
   // OVERVIEW: Maps are associative containers that store elements
@@ -50,7 +66,7 @@ public:
   // Type alias for iterator type. It is sufficient to use the Iterator
   // from BinarySearchTree<Pair_type> since it will yield elements of Pair_type
   // in the appropriate order for the Map.
-  using Iterator = typename BinarySearchTree<Pair_type, PairComp>::Iterator;
+  using Iterator = typename Tree_type::Iterator;
 
   // You should add in a default constructor, destructor, copy
   // constructor, and overloaded assignment operator, if appropriate.
@@ -99,15 +115,8 @@ public:
   //
   // HINT: http://www.cplusplus.com/reference/map/map/operator[]/
   Value_type& operator[](const Key_type& k) {
-    Iterator find_pair_it = find(k);
-    if (find_pair_it == end()) { // key not in Map
-      Pair_type pair{k, Value_type()};
-      Iterator insert_pair_it = insert(pair).first;
-      Pair_type & insert_pair = *insert_pair_it;
-      return insert_pair.second;
-    }
-    Pair_type & find_pair = *find_pair_it;
-    return find_pair.second;
+    Pair_type & pair = *try_emplace(k).first;
+    return pair.second;
   }
 
   // MODIFIES: this
@@ -119,12 +128,26 @@ public:
   //           an iterator to the newly inserted element, along with
   //           the value true.
   std::pair<Iterator, bool> insert(const Pair_type &val) {
-    Iterator find_pair_it = find(val.first);
-    if(find_pair_it == end()) { // key not in Map 
-      Iterator insert_pair_it = bst.insert(val);
-      return std::pair<Iterator, bool>{insert_pair_it, true};    
-    }
-    return std::pair<Iterator, bool>{find_pair_it, false};
+    return bst.find_or_emplace(val, val);
+  }
+
+  // MODIFIES: this
+  // EFFECTS : Inserts an element with key k and a mapped value
+  //           constructed from args if k is not already contained in
+  //           the Map, and returns an iterator to it along with the
+  //           value true. Otherwise, returns an iterator to the existing
+  //           element along with the value false, and args are not used.
+  //           With no args, the mapped value is value-initialized.
+  //
+  // NOTE: Like operator[] and insert, this descends the tree only once.
+  //       The search compares k against the stored keys directly, so an
+  //       element is only constructed when one is inserted.
+  // HINT: http://www.cplusplus.com/reference/map/map/try_emplace/
+  template <typename... Args>
+  std::pair<Iterator, bool> try_emplace(const Key_type& k, Args&&... args) {
+    return bst.find_or_emplace(k, std::piecewise_construct,
+                               std::forward_as_tuple(k),
+                               std::forward_as_tuple(std::forward<Args>(args)...));
   }
 
   // EFFECTS : Returns an iterator to the first key-value pair in this Map.
@@ -139,7 +162,7 @@ public:
 
 private:
   // Add a BinarySearchTree private member HERE.
-  BinarySearchTree<Pair_type, PairComp> bst;
+  Tree_type bst;
 };
 
 // You may implement member functions below using an "out-of-line" definition
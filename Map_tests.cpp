@@ -87,5 +87,82 @@ TEST(test_map_iterator_begin) {
     ASSERT_EQUAL(*m.begin(), element);  
 }
 
+TEST(test_map_sorted_keys) {
+    Map<int, int> m;
+    for (int i = 0; i < 100000; ++i) { // linear time per insert if unbalanced
+        m[i] = 2 * i;
+    }
+    ASSERT_EQUAL(m.size(), 100000u);
+    ASSERT_EQUAL(m[99999], 199998);
+
+    int expected = 0;
+    for (auto &elt : m) {
+        ASSERT_EQUAL(elt.first, expected);
+        ASSERT_EQUAL(elt.second, 2 * expected);
+        ++expected;
+    }
+}
+
+TEST(test_map_allocators) {
+    Map<std::string, int> arena;
+    Map<std::string, int, std::less<std::string>, NewNodeAllocator> heap;
+    for (int i = 0; i < 5000; ++i) {
+        arena[std::to_string(i)] = i;
+        heap[std::to_string(i)] = i;
+    }
+    Map<std::string, int> arena_copy(arena);
+    arena = Map<std::string, int>();
+    ASSERT_TRUE(arena.empty());
+    ASSERT_EQUAL(arena_copy.size(), 5000u);
+    ASSERT_EQUAL(heap.size(), 5000u);
+
+    auto heap_it = heap.begin();
+    for (auto &elt : arena_copy) {
+        ASSERT_EQUAL(elt, *heap_it);
+        ++heap_it;
+    }
+    ASSERT_TRUE(heap_it == heap.end());
+}
+
+TEST(test_map_try_emplace) {
+    Map<std::string, std::string> m;
+    auto result = m.try_emplace("key", 3, 'x');
+    ASSERT_TRUE(result.second);
+    ASSERT_EQUAL(result.first->first, "key");
+    ASSERT_EQUAL(result.first->second, "xxx");
+
+    result = m.try_emplace("key", 5, 'y'); // existing value kept
+    ASSERT_FALSE(result.second);
+    ASSERT_EQUAL(result.first->second, "xxx");
+
+    result = m.try_emplace("empty");
+    ASSERT_TRUE(result.second);
+    ASSERT_EQUAL(result.first->second, "");
+    ASSERT_EQUAL(m.size(), 2u);
+
+    auto inserted = m.insert({"key", "zzz"});
+    ASSERT_FALSE(inserted.second);
+    ASSERT_EQUAL(m["key"], "xxx");
+    ASSERT_TRUE(m.insert({"other", "zzz"}).second);
+    ASSERT_EQUAL(m["other"], "zzz");
+    ASSERT_EQUAL(m.size(), 3u);
+
+    Map<int, int> counts;
+    for (int i = 0; i < 1000; ++i) {
+        ++counts[i % 10];
+    }
+    ASSERT_EQUAL(counts.size(), 10u);
+    ASSERT_EQUAL(counts[7], 100);
+
+    struct NoDefault {
+        explicit NoDefault(int value_in) : value(value_in) {}
+        int value;
+    };
+    Map<int, NoDefault> no_default;
+    ASSERT_TRUE(no_default.try_emplace(1, 10).second);
+    ASSERT_FALSE(no_default.try_emplace(1, 20).second);
+    ASSERT_EQUAL(no_default.begin()->second.value, 10);
+}
+
 
 TEST_MAIN()
\ No newline at end of file
@@ -14,10 +14,61 @@
 #include <sstream>
 #include <cassert>
 #include <string>
+#include <string_view>
+#include <utility>
 #include <vector>
 #include <map>
+#include <array>
 #include <regex>
+#include <algorithm>
 #include <exception>
+#include <cstdio>
+#include <cstring>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+// The filename constructor memory-maps regular files where POSIX mmap is
+// available, and reads them through std::ifstream everywhere else.
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <poll.h>
+#include <unistd.h>
+#include <cerrno>
+#define CSVSTREAM_MMAP 1
+#endif
+
+// On Linux, the filename constructor can also read files through io_uring,
+// talking to the kernel directly.  Kernels and sandboxes without io_uring
+// fall back to the other ways of reading at run time.
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <cerrno>
+#include <cstdlib>
+#define CSVSTREAM_URING 1
+#endif
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+// Compressed input is decoded by programs that define CSVSTREAM_ZLIB and link
+// with zlib (-lz) for gzip, or define CSVSTREAM_ZSTD and link with libzstd
+// (-lzstd) for zstd.
+#ifdef CSVSTREAM_ZLIB
+#include <zlib.h>
+#endif
+#ifdef CSVSTREAM_ZSTD
+#include <zstd.h>
+#endif
 
 
 // A custom exception type
@@ -31,14 +82,114 @@ public:
 };
 
 
+// One row read by csvstream.  The characters of every field are kept in one
+// buffer, and each field is a view into it.  Reusing a csvrow from one read
+// to the next keeps its buffers, so reading allocates nothing once they are
+// big enough.
+class csvrow {
+public:
+  // Return the number of fields
+  size_t size() const {
+    return starts.size();
+  }
+
+  // Return field i.  The view is valid until the row is read into again.
+  std::string_view operator[] (size_t i) const {
+    return std::string_view(chars.data() + starts[i], ends[i] - starts[i]);
+  }
+
+private:
+  friend class csv_row_fields;
+
+  // Characters of every field, one after another
+  std::string chars;
+
+  // Field i is chars[starts[i], ends[i])
+  std::vector<size_t> starts;
+  std::vector<size_t> ends;
+};
+
+
+// A row read by csvstream into the members of a Record that are given as
+// template arguments, for example csvrecord<post, &post::tag, &post::content>.
+// The i-th member is set from the i-th selected column, so columns are bound
+// to members by name once, with select_columns(), and every row is decoded by
+// index.  Members may be std::string, which get a copy of their field, or
+// std::string_view, which are valid until the record is read into again.
+template <typename Record, auto... Members>
+class csvrecord : public Record {
+public:
+  // Number of members, which must be the number of selected columns
+  static const size_t size = sizeof...(Members);
+
+  // Set the members of record from the fields of row, in order
+  static void decode(const csvrow &row, Record &record) {
+    decode(row, record, std::make_index_sequence<size>());
+  }
+
+private:
+  friend class csvstream;
+
+  template <size_t... I>
+  static void decode(const csvrow &row, Record &record,
+                     std::index_sequence<I...>) {
+    ((record.*Members = row[I]), ...);
+  }
+
+  // Row the fields of the last read are kept in
+  csvrow fields;
+};
+
+
+// A range of lines read by csvstream::read_parallel()
+struct csv_chunk;
+
+// Characters for the bulk parser
+class csv_source;
+
+// Parsed lines saved next to a CSV file
+class csv_cache;
+
+
+// Options for how csvstream reads its input, combined with |
+enum csvstream_flags {
+  // Read input that cannot be mapped, such as pipes, ahead of the parser on
+  // a background thread, handing over whatever has arrived in blocks of up
+  // to 256 KiB.  Files opened by name are read by file descriptor.
+  CSVSTREAM_READ_AHEAD = 1,
+
+  // Files opened by name: save every parsed line to a columnar cache file
+  // next to the file, named with .csvcache added, and read that instead of
+  // parsing the file as long as the file's size and mtime do not change.
+  CSVSTREAM_CACHE = 2,
+
+  // Decompress zstd files opened by name that hold more than one frame, such
+  // as those written by pzstd, one frame per thread.  Other compressed input
+  // is decompressed on the parsing thread.
+  CSVSTREAM_PARALLEL_DECODE = 4,
+
+  // Files opened by name: read regular files on Linux through io_uring, with
+  // several large reads in flight ahead of the parser, instead of mapping
+  // them.  Ignored where io_uring is not available.
+  CSVSTREAM_IO_URING = 8,
+
+  // With CSVSTREAM_IO_URING: read with O_DIRECT, bypassing the page cache,
+  // on file systems that support it
+  CSVSTREAM_DIRECT_IO = 16
+};
+
+
 // csvstream interface
 class csvstream {
 public:
   // Constructor from filename. Throws csvstream_exception if open fails.
-  csvstream(const std::string &filename, char delimiter=',', bool strict=true);
+  // flags is a combination of csvstream_flags.
+  csvstream(const std::string &filename, char delimiter=',', bool strict=true,
+            unsigned flags=0);
 
-  // Constructor from stream
-  csvstream(std::istream &is, char delimiter=',', bool strict=true);
+  // Constructor from stream.  flags is a combination of csvstream_flags.
+  csvstream(std::istream &is, char delimiter=',', bool strict=true,
+            unsigned flags=0);
 
   // Destructor
   ~csvstream();
@@ -58,6 +209,50 @@ public:
   // header.
   csvstream & operator>> (std::vector<std::pair<std::string, std::string> >& row);
 
+  // Stream extraction operator reads one row into a reusable row, without
+  // allocating once the row's buffers are big enough.  Reads the selected
+  // columns if select_columns() was called, and every column otherwise.
+  // Throws csvstream_exception if the number of items in the row does not
+  // match the header.
+  csvstream & operator>> (csvrow& row);
+
+  // Choose the columns read by operator>>(std::array), operator>>(csvrow) and
+  // operator>>(csvrecord), by header name or by index, in the order they should
+  // appear in the row.  Throws csvstream_exception if a name is not in the
+  // header, an index is out of range, or a column is selected more than once.
+  void select_columns(const std::vector<std::string> &names);
+  void select_column_indices(const std::vector<size_t> &indices);
+
+  // Stream extraction operator reads the selected columns of one row into
+  // fields, without copying the other columns.  Reuses the strings already in
+  // fields.  Throws csvstream_exception if N is not the number of selected
+  // columns, or if the number of items in the row does not match the header.
+  template <size_t N>
+  csvstream & operator>> (std::array<std::string, N>& fields);
+
+  // Stream extraction operator reads the selected columns of one row into
+  // the members of record, in order.  Throws csvstream_exception if record
+  // does not have one member per selected column, or if the number of items
+  // in the row does not match the header.
+  template <typename Record, auto... Members>
+  csvstream & operator>> (csvrecord<Record, Members...>& record);
+
+  // Read every remaining row, as operator>>(csvrow) would, and pass them to
+  // handle(chunk, rows) in chunks of about chunk_size bytes, numbered from 0
+  // in file order.  A mapped file is split at line boundaries that take
+  // quoted line endings into account, and the chunks are parsed by
+  // num_threads threads.  If ordered, handle is called on this thread, one
+  // chunk at a time, in file order.  Otherwise handle is called on the
+  // parsing threads, concurrently, as chunks are parsed.  Other input is
+  // read on this thread.  Rethrows the first exception thrown by parsing or
+  // by handle, after stopping the threads.
+  typedef std::function<void (size_t chunk, std::vector<csvrow> &rows)>
+    chunk_handler;
+  void read_parallel(size_t num_threads,
+                     bool ordered,
+                     const chunk_handler &handle,
+                     size_t chunk_size=1 << 20);
+
 private:
   // Filename.  Used for error messages.
   std::string filename;
@@ -82,6 +277,61 @@ private:
   // Store header column names
   std::vector<std::string> header;
 
+  // For each column of the header, its index among the selected columns, or
+  // -1 if it is not selected
+  std::vector<int> selected_slots;
+
+  // Number of selected columns
+  size_t num_selected;
+
+  // Memory-mapped file contents, used by the filename ctor when the file can
+  // be mapped.  map_begin is null when nothing is mapped.
+  const char *map_begin;
+  const char *map_end;
+
+  // Where the bulk parser reads from: the mapped file, the buffer of is,
+  // blocks read ahead from is, or a decoder reading one of those.  Null when
+  // is is parsed one character at a time.
+  std::unique_ptr<csv_source> source;
+
+  // Lines read from a cache file instead of parsing, and the index of the
+  // next one to read.  Null when not reading from a cache.
+  std::unique_ptr<csv_cache> cache;
+  size_t next_cached_line;
+
+  // Map filename into memory.  Return false, leaving nothing mapped, if the
+  // file cannot be mapped.
+  bool map_file(const std::string &filename);
+
+  // Set up reading from is according to flags
+  void open_stream(unsigned flags);
+
+  // Read filename by its file descriptor on a background thread.  Return
+  // false if it cannot be opened that way.
+  bool open_read_ahead(const std::string &filename);
+
+  // Read filename through io_uring.  Return false if it cannot be.
+  bool open_uring(unsigned flags);
+
+  // Put a decoder in front of source if the input starts with the magic
+  // bytes of gzip or zstd.  Throws csvstream_exception if the format is not
+  // compiled in.
+  void open_decoder(unsigned flags);
+
+  // Read from the cache of filename, writing it first if it is missing or
+  // out of date.  Return false if there cannot be a cache.
+  bool open_cache(unsigned flags);
+
+  // Read and tokenize one line from the mapped file or from is into sink
+  template <typename Sink>
+  bool read_line(Sink &sink);
+
+  // Parse the lines of a chunk of the mapped file into its rows
+  void parse_chunk(csv_chunk &chunk) const;
+
+  // Throw csvstream_exception reporting a row with the wrong number of items
+  void throw_row_size_error(size_t line, size_t row_size) const;
+
   // Process header, the first line of the file
   void read_header();
 
@@ -94,15 +344,166 @@ private:
 ///////////////////////////////////////////////////////////////////////////////
 // Implementation
 
+// The parsers below hand the characters of each field to a sink.  A sink
+// has start(), called before a line is read, next_field(), called at each
+// delimiter, and append(), which adds a character or a range of characters
+// to the current field.
+
+// Sink that stores every field of a line in a vector of strings
+class csv_all_fields {
+public:
+  csv_all_fields(std::vector<std::string> &data) : data(data) {}
+
+  void start() {
+    // Add entry for first token, start with empty string
+    data.clear();
+    data.push_back(std::string());
+  }
+
+  void next_field() {
+    data.push_back(std::string());
+  }
+
+  void append(char c) {
+    data.back() += c;
+  }
+
+  void append(const char *first, const char *last) {
+    data.back().append(first, last);
+  }
+
+private:
+  std::vector<std::string> &data;
+};
+
+
+// Sink that stores only the fields of selected columns, each in its own
+// string, and counts the rest
+class csv_selected_fields {
+public:
+  // slots has an entry for each column: its index in fields, or -1 to skip
+  // the column
+  csv_selected_fields(const std::vector<int> &slots,
+                      std::string *fields,
+                      size_t num_fields)
+    : slots(slots), fields(fields), num_fields(num_fields), size(0),
+      current(nullptr) {}
+
+  void start() {
+    for (size_t i=0; i<num_fields; ++i) {
+      fields[i].clear();
+    }
+    size = 0;
+    next_field();
+  }
+
+  void next_field() {
+    current = size < slots.size() && slots[size] >= 0 ?
+      &fields[slots[size]] : nullptr;
+    size += 1;
+  }
+
+  void append(char c) {
+    if (current) *current += c;
+  }
+
+  void append(const char *first, const char *last) {
+    if (current) current->append(first, last);
+  }
+
+  // Number of fields in the line, selected or not
+  size_t row_size() const {
+    return size;
+  }
+
+private:
+  const std::vector<int> &slots;
+  std::string *fields;
+  size_t num_fields;
+  size_t size;
+  std::string *current;
+};
+
+
+// Sink that stores the fields of a line in a csvrow, either every field or
+// only those of selected columns
+class csv_row_fields {
+public:
+  // If slots is null, every field is stored.  Otherwise slots has an entry
+  // for each column: its index among the num_fields stored fields, or -1 to
+  // skip the column.
+  csv_row_fields(csvrow &row, const std::vector<int> *slots, size_t num_fields)
+    : row(row), slots(slots), num_fields(num_fields), size(0), current(-1) {}
+
+  void start() {
+    row.chars.clear();
+    if (slots) {
+      row.starts.assign(num_fields, 0);
+      row.ends.assign(num_fields, 0);
+    } else {
+      row.starts.clear();
+      row.ends.clear();
+    }
+    size = 0;
+    next_field();
+  }
+
+  void next_field() {
+    if (!slots) {
+      current = static_cast<int>(size);
+      row.starts.push_back(row.chars.size());
+      row.ends.push_back(row.chars.size());
+    } else {
+      current = size < slots->size() ? (*slots)[size] : -1;
+      if (current >= 0) {
+        row.starts[current] = row.ends[current] = row.chars.size();
+      }
+    }
+    size += 1;
+  }
+
+  void append(char c) {
+    if (current < 0) return;
+    row.chars += c;
+    row.ends[current] = row.chars.size();
+  }
+
+  void append(const char *first, const char *last) {
+    if (current < 0) return;
+    row.chars.append(first, last);
+    row.ends[current] = row.chars.size();
+  }
+
+  // Number of fields in the line, stored or not
+  size_t row_size() const {
+    return size;
+  }
+
+  // Add empty fields to, or drop fields from, the end of a row that stores
+  // every field, so that it has n fields
+  void resize(size_t n) {
+    if (slots) return;
+    row.starts.resize(n, row.chars.size());
+    row.ends.resize(n, row.chars.size());
+  }
+
+private:
+  csvrow &row;
+  const std::vector<int> *slots;
+  size_t num_fields;
+  size_t size;
+  int current;
+};
+
+
 // Read and tokenize one line from a stream
+template <typename Sink>
 static bool read_csv_line(std::istream &is,
-                          std::vector<std::string> &data,
+                          Sink &sink,
                           char delimiter
                           ) {
 
-  // Add entry for first token, start with empty string
-  data.clear();
-  data.push_back(std::string());
+  sink.start();
 
   // Process one character at a time
   char c = '\0';
@@ -127,10 +528,10 @@ static bool read_csv_line(std::istream &is,
         state = QUOTED;
       } else if (c == '\\') { //note this checks for a single backslash char
         state = UNQUOTED_ESCAPED;
-        data.back() += c;
+        sink.append(c);
       } else if (c == delimiter) {
         // If you see a delimiter, then start a new field with an empty string
-        data.push_back("");
+        sink.next_field();
       } else if (c == '\n' || c == '\r') {
         // If you see a line ending *and it's not within a quoted token*, stop
         // parsing the line.  Works for UNIX (\n) and OSX (\r) line endings.
@@ -138,13 +539,13 @@ static bool read_csv_line(std::istream &is,
         state = END;
       } else {
         // Append character to current token
-        data.back() += c;
+        sink.append(c);
       }
       break;
 
     case UNQUOTED_ESCAPED:
       // If a character is escaped, add it no matter what.
-      data.back() += c;
+      sink.append(c);
       state = UNQUOTED;
       break;
 
@@ -154,16 +555,16 @@ static bool read_csv_line(std::istream &is,
         state = UNQUOTED;
       } else if (c == '\\') {
         state = QUOTED_ESCAPED;
-        data.back() += c;
+        sink.append(c);
       } else {
         // Append character to current token
-        data.back() += c;
+        sink.append(c);
       }
       break;
 
     case QUOTED_ESCAPED:
       // If a character is escaped, add it no matter what.
-      data.back() += c;
+      sink.append(c);
       state = QUOTED;
       break;
 
@@ -199,36 +600,1446 @@ static bool read_csv_line(std::istream &is,
 }
 
 
-csvstream::csvstream(const std::string &filename, char delimiter, bool strict)
+// Return a pointer to the first character in [p, end) that the unquoted
+// state of read_csv_line() treats specially: a double quote, a backslash, the
+// delimiter or a line ending.  Return end if there is none.  Scans 32 or 16
+// characters at a time where AVX2 or SSE2 is available.
+static const char * csv_scan_unquoted(const char *p,
+                                      const char *end,
+                                      char delimiter
+                                      ) {
+#if defined(__AVX2__)
+  const __m256i quote = _mm256_set1_epi8('"');
+  const __m256i backslash = _mm256_set1_epi8('\\');
+  const __m256i delim = _mm256_set1_epi8(delimiter);
+  const __m256i newline = _mm256_set1_epi8('\n');
+  const __m256i carriage_return = _mm256_set1_epi8('\r');
+  for (; end - p >= 32; p += 32) {
+    const __m256i chunk = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p));
+    const __m256i hits =
+      _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(chunk, quote),
+                                      _mm256_cmpeq_epi8(chunk, backslash)),
+                      _mm256_or_si256(_mm256_cmpeq_epi8(chunk, delim),
+                                      _mm256_or_si256(_mm256_cmpeq_epi8(chunk, newline),
+                                                      _mm256_cmpeq_epi8(chunk, carriage_return))));
+    const unsigned mask = static_cast<unsigned>(_mm256_movemask_epi8(hits));
+    if (mask) return p + __builtin_ctz(mask);
+  }
+#endif
+#if defined(__SSE2__)
+  const __m128i quote16 = _mm_set1_epi8('"');
+  const __m128i backslash16 = _mm_set1_epi8('\\');
+  const __m128i delim16 = _mm_set1_epi8(delimiter);
+  const __m128i newline16 = _mm_set1_epi8('\n');
+  const __m128i carriage_return16 = _mm_set1_epi8('\r');
+  for (; end - p >= 16; p += 16) {
+    const __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+    const __m128i hits =
+      _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(chunk, quote16),
+                                _mm_cmpeq_epi8(chunk, backslash16)),
+                   _mm_or_si128(_mm_cmpeq_epi8(chunk, delim16),
+                                _mm_or_si128(_mm_cmpeq_epi8(chunk, newline16),
+                                             _mm_cmpeq_epi8(chunk, carriage_return16))));
+    const unsigned mask = static_cast<unsigned>(_mm_movemask_epi8(hits));
+    if (mask) return p + __builtin_ctz(mask);
+  }
+#endif
+  for (; p != end; ++p) {
+    const char c = *p;
+    if (c == '"' || c == '\\' || c == delimiter || c == '\n' || c == '\r') break;
+  }
+  return p;
+}
+
+
+// Return a pointer to the first double quote or backslash in [p, end), the
+// characters the quoted state of read_csv_line() treats specially.  Return
+// end if there is none.
+static const char * csv_scan_quoted(const char *p, const char *end) {
+#if defined(__SSE2__)
+  const __m128i quote = _mm_set1_epi8('"');
+  const __m128i backslash = _mm_set1_epi8('\\');
+  for (; end - p >= 16; p += 16) {
+    const __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+    const __m128i hits = _mm_or_si128(_mm_cmpeq_epi8(chunk, quote),
+                                      _mm_cmpeq_epi8(chunk, backslash));
+    const unsigned mask = static_cast<unsigned>(_mm_movemask_epi8(hits));
+    if (mask) return p + __builtin_ctz(mask);
+  }
+#endif
+  for (; p != end && *p != '"' && *p != '\\'; ++p);
+  return p;
+}
+
+
+// Characters for the bulk parser: a window [next, end) of the input, which
+// refill() moves forward.  A plain csv_source is one block of memory.
+class csv_source {
+public:
+  csv_source(const char *next=nullptr, const char *end=nullptr)
+    : next(next), end(end) {}
+
+  virtual ~csv_source() {}
+
+  // Called once the window is used up.  Return false at the end of the
+  // input, otherwise make the next characters of the input the window.
+  virtual bool refill() {
+    return false;
+  }
+
+  // Called after each line is read, with next just past the line
+  virtual void end_line() {}
+
+  const char *next;
+  const char *end;
+};
+
+
+// Read and tokenize one line from source, advancing it past the line.
+// Produces exactly the same tokens as the stream version of read_csv_line()
+// above, but copies runs of ordinary characters in bulk and only steps one
+// character at a time over quotes, escapes and delimiters.
+template <typename Sink>
+static bool read_csv_line(csv_source &source,
+                          Sink &sink,
+                          char delimiter
+                          ) {
+  sink.start();
+
+  // Nothing left to extract
+  if (source.next == source.end && !source.refill()) return false;
+
+  // Move the window forward once [p, end) is used up
+  const char *p = source.next;
+  const char *end = source.end;
+  auto more = [&source, &p, &end]() {
+    source.next = p;
+    if (!source.refill()) return false;
+    p = source.next;
+    end = source.end;
+    return true;
+  };
+
+  bool quoted = false;
+  while (p != end || more()) {
+    // Copy everything up to the next special character into the token
+    const char *special = quoted ? csv_scan_quoted(p, end)
+                                 : csv_scan_unquoted(p, end, delimiter);
+    sink.append(p, special);
+    p = special;
+    if (p == end) continue;
+
+    // Same tests, in the same order, as the stream state machine
+    const char c = *p++;
+    if (c == '"') {
+      // Change states when we see a double quote
+      quoted = !quoted;
+    } else if (c == '\\') {
+      // Keep the backslash, and add the escaped character no matter what
+      sink.append(c);
+      if (p == end && !more()) break;
+      sink.append(*p++);
+    } else if (c == delimiter) {
+      // If you see a delimiter, then start a new field with an empty string
+      sink.next_field();
+    } else {
+      // Line ending outside a quoted token.  Consume it, and the second
+      // character of a Windows line ending (\r\n), then stop parsing.
+      if ((p != end || more()) && *p == '\n') ++p;
+      source.next = p;
+      return true;
+    }
+  }
+
+  // A partial line at the end of the input still counts, like getline()
+  source.next = source.end;
+  return true;
+}
+
+
+// Access to the get area of any stream buffer, which is protected.  Pointers
+// to the members of std::streambuf are formed through this derived class,
+// and can then be used on any stream buffer.
+struct csv_get_area : std::streambuf {
+  static char * begin(std::streambuf *buf) {
+    return (buf->*&csv_get_area::gptr)();
+  }
+
+  static char * end(std::streambuf *buf) {
+    return (buf->*&csv_get_area::egptr)();
+  }
+
+  // Move the start of the get area forward n characters
+  static void consume(std::streambuf *buf, size_t n) {
+    const size_t max_bump = static_cast<size_t>(std::numeric_limits<int>::max());
+    for (; n > max_bump; n -= max_bump) {
+      (buf->*&csv_get_area::gbump)(static_cast<int>(max_bump));
+    }
+    (buf->*&csv_get_area::gbump)(static_cast<int>(n));
+  }
+};
+
+
+// Source whose window is the get area of a stream's buffer, so that lines
+// are parsed straight out of the buffer without a virtual call per
+// character.  The buffer is moved past each line once it is read, leaving
+// the stream where the stream version of read_csv_line() would.
+class csv_streambuf_source : public csv_source {
+public:
+  csv_streambuf_source(std::istream &is)
+    : is(is), buf(is.rdbuf()), window(nullptr), single('\0') {}
+
+  ~csv_streambuf_source() {
+    end_line();
+  }
+
+  // Return whether the buffer of is has a get area to read from, filling it
+  // if it is empty.  Unbuffered streams have none.
+  static bool buffered(std::istream &is) {
+    std::streambuf *buf = is.rdbuf();
+    if (!buf) return false;
+    if (csv_get_area::begin(buf) == csv_get_area::end(buf)) {
+      flush_tie(is);
+      buf->sgetc();
+    }
+    return csv_get_area::begin(buf) != csv_get_area::end(buf);
+  }
+
+  bool refill() override {
+    end_line();
+    flush_tie(is);
+    if (std::streambuf::traits_type::eq_int_type(
+          buf->sgetc(), std::streambuf::traits_type::eof())) {
+      window = nullptr;
+      return false;
+    }
+    window = csv_get_area::begin(buf);
+    next = window;
+    end = csv_get_area::end(buf);
+    if (next == end) {
+      // No get area after all: take the character out of the buffer
+      window = nullptr;
+      single = std::streambuf::traits_type::to_char_type(buf->sbumpc());
+      next = &single;
+      end = next + 1;
+    }
+    return true;
+  }
+
+  void end_line() override {
+    if (window) {
+      csv_get_area::consume(buf, next - window);
+      window = next;
+    }
+  }
+
+private:
+  // Flush the stream tied to is before reading, as is.get() would
+  static void flush_tie(std::istream &is) {
+    if (std::ostream *tied = is.tie()) tied->flush();
+  }
+
+  std::istream &is;
+  std::streambuf *buf;
+  const char *window;  // start of the window not yet consumed from buf
+  char single;         // character taken from a buffer without a get area
+};
+
+
+// Source that reads blocks on a background thread, ahead of the parser, so
+// that reading and parsing overlap.  Up to NUM_BLOCKS blocks are filled at
+// once, one of them being parsed while the others are read.  A block is
+// handed to the parser as soon as anything has been read into it, so rows
+// from a slow pipe are not held back until a whole block arrives.
+//
+// The reader reads a file descriptor when it has one, waiting for input
+// with poll() so that destroying the source wakes it at once.  Otherwise it
+// reads a stream buffer, and only waits for more input than the buffer has
+// when it has none at all.  A reader still waiting on a stream buffer when
+// the source is destroyed is detached rather than joined, so the stream
+// buffer must outlive that read, as std::cin's does.
+class csv_read_ahead_source : public csv_source {
+public:
+  // Read buf, or the file descriptor fd if it is not -1, which the source
+  // then owns
+  csv_read_ahead_source(std::streambuf *buf, int fd = -1)
+    : shared(std::make_shared<state>(buf, fd)) {
+    reader = std::thread(&csv_read_ahead_source::read, shared);
+  }
+
+  ~csv_read_ahead_source() {
+    bool waiting;
+    {
+      std::lock_guard<std::mutex> lock(shared->mutex);
+      shared->stopping = true;
+      waiting = shared->waiting;
+    }
+    shared->changed.notify_all();
+#ifdef CSVSTREAM_MMAP
+    if (shared->fd >= 0) {
+      // Wake the reader from poll()
+      const char stop = 0;
+      while (write(shared->wake[1], &stop, 1) < 0 && errno == EINTR) {}
+      waiting = false;
+    }
+#endif
+    if (waiting) {
+      reader.detach();
+    } else {
+      reader.join();
+    }
+  }
+
+  bool refill() override {
+    state &s = *shared;
+    std::unique_lock<std::mutex> lock(s.mutex);
+    if (s.holding) {
+      // Hand the block just parsed back to the reader
+      s.holding = false;
+      s.changed.notify_all();
+    }
+    s.changed.wait(lock, [&s] { return s.num_filled > 0 || s.done; });
+    if (s.num_filled == 0) {
+      if (s.error) std::rethrow_exception(s.error);
+      return false;
+    }
+    const block &taken = s.blocks[s.next_take];
+    s.next_take = (s.next_take + 1) % NUM_BLOCKS;
+    s.num_filled -= 1;
+    s.holding = true;
+    s.changed.notify_all();
+    next = taken.chars.data();
+    end = next + taken.size;
+    return true;
+  }
+
+private:
+  static const size_t NUM_BLOCKS = 3;
+  static const size_t BLOCK_LENGTH = 1 << 18;
+
+  struct block {
+    std::vector<char> chars;
+    size_t size;
+  };
+
+  // Everything the reader thread uses, which it shares so that it can be
+  // detached
+  struct state {
+    state(std::streambuf *buf, int fd)
+      : buf(buf), fd(fd), num_filled(0), next_fill(0), next_take(0),
+        holding(false), done(false), stopping(false), waiting(false) {
+#ifdef CSVSTREAM_MMAP
+      wake[0] = wake[1] = -1;
+      if (fd >= 0 && pipe(wake) != 0) {
+        close(fd);
+        throw csvstream_exception("Error starting read-ahead");
+      }
+#endif
+    }
+
+    ~state() {
+#ifdef CSVSTREAM_MMAP
+      if (fd >= 0) {
+        close(fd);
+        close(wake[0]);
+        close(wake[1]);
+      }
+#endif
+    }
+
+    std::streambuf *buf;
+    int fd;
+    int wake[2];        // pipe that the destructor writes to, to stop poll()
+    block blocks[NUM_BLOCKS];
+    size_t num_filled;  // blocks read and not yet taken by refill()
+    size_t next_fill;   // block the reader fills next
+    size_t next_take;   // block refill() takes next
+    bool holding;       // whether the parser holds a block
+    bool done;          // the reader reached the end of the input
+    bool stopping;      // the source is being destroyed
+    bool waiting;       // the reader is waiting on buf for more input
+    std::exception_ptr error;
+    std::mutex mutex;
+    std::condition_variable changed;
+  };
+
+  // Body of the reader thread: fill free blocks, in order, until the end of
+  // the input
+  static void read(std::shared_ptr<state> shared) {
+    state &s = *shared;
+    std::unique_lock<std::mutex> lock(s.mutex);
+    while (true) {
+      s.changed.wait(lock, [&s] {
+        return s.stopping || s.num_filled + s.holding < NUM_BLOCKS;
+      });
+      if (s.stopping) return;
+      block &filling = s.blocks[s.next_fill];
+      lock.unlock();
+
+      size_t size = 0;
+      std::exception_ptr read_error;
+      try {
+        filling.chars.resize(BLOCK_LENGTH);
+        size = s.fd >= 0 ? read_fd(s, filling.chars.data())
+                         : read_buf(s, lock, filling.chars.data());
+      } catch (...) {
+        read_error = std::current_exception();
+      }
+
+      if (!lock) lock.lock();
+      s.waiting = false;
+      if (s.stopping) return;
+      filling.size = size;
+      if (size > 0) {
+        s.next_fill = (s.next_fill + 1) % NUM_BLOCKS;
+        s.num_filled += 1;
+      } else {
+        // Nothing more to read
+        s.error = read_error;
+        s.done = true;
+      }
+      s.changed.notify_all();
+      if (s.done) return;
+    }
+  }
+
+  // Read what has arrived on s.fd, up to a block, waiting for some if
+  // nothing has.  Return 0 at the end of the input or when stopping.
+  static size_t read_fd(state &s, char *chars) {
+#ifdef CSVSTREAM_MMAP
+    pollfd fds[2];
+    fds[0].fd = s.fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = s.wake[0];
+    fds[1].events = POLLIN;
+    while (true) {
+      fds[0].revents = fds[1].revents = 0;
+      if (poll(fds, 2, -1) < 0) {
+        if (errno == EINTR) continue;
+        throw csvstream_exception("Error reading input");
+      }
+      if (fds[1].revents) return 0;
+      const ssize_t size = ::read(s.fd, chars, BLOCK_LENGTH);
+      if (size >= 0) return static_cast<size_t>(size);
+      if (errno != EINTR && errno != EAGAIN) {
+        throw csvstream_exception("Error reading input");
+      }
+    }
+#else
+    (void) s;
+    (void) chars;
+    return 0;
+#endif
+  }
+
+  // Read what s.buf has without waiting, up to a block.  If it has nothing,
+  // wait for some first, with s.waiting set and the lock held by lock
+  // released.  Return 0 at the end of the input.
+  static size_t read_buf(state &s, std::unique_lock<std::mutex> &lock,
+                         char *chars) {
+    typedef std::streambuf::traits_type traits;
+    if (!s.buf) return 0;
+    std::streamsize available = s.buf->in_avail();
+    if (available == 0) {
+      lock.lock();
+      if (s.stopping) return 0;
+      s.waiting = true;
+      lock.unlock();
+      const bool at_end = traits::eq_int_type(s.buf->sgetc(), traits::eof());
+      lock.lock();
+      s.waiting = false;
+      if (s.stopping || at_end) return 0;
+      lock.unlock();
+      // A buffer without a get area may still not know how much it has
+      available = std::max<std::streamsize>(s.buf->in_avail(), 1);
+    }
+    if (available < 0) return 0;
+    const std::streamsize length = static_cast<std::streamsize>(BLOCK_LENGTH);
+    const std::streamsize size =
+      s.buf->sgetn(chars, available < length ? available : length);
+    return static_cast<size_t>(size > 0 ? size : 0);
+  }
+
+  std::shared_ptr<state> shared;
+  std::thread reader;
+};
+
+
+#ifdef CSVSTREAM_MMAP
+// Source over a whole mapped file, which it unmaps when destroyed
+class csv_mapped_source : public csv_source {
+public:
+  csv_mapped_source(const char *begin, const char *end)
+    : csv_source(begin, end), begin(begin), size(end - begin) {}
+
+  ~csv_mapped_source() {
+    munmap(const_cast<char *>(begin), size);
+  }
+
+private:
+  const char *begin;
+  size_t size;
+};
+#endif
+
+
+#ifdef CSVSTREAM_URING
+// Source that reads a regular file through io_uring.  Reads of BLOCK_LENGTH
+// characters go into NUM_BUFFERS aligned buffers, so that that many reads
+// are in flight ahead of the parser.  The buffers are handed to the parser
+// in file order, and each is read into again once the parser is done with
+// it.  Block i of the file is read into buffer i % NUM_BUFFERS.
+class csv_uring_source : public csv_source {
+public:
+  csv_uring_source()
+    : fd(-1), ring_fd(-1), sq_ring(MAP_FAILED), cq_ring(MAP_FAILED),
+      sqes(MAP_FAILED), sq_ring_size(0), cq_ring_size(0), sqes_size(0),
+      file_size(0), next_block(0), num_in_flight(0), holding(false),
+      failed(false) {}
+
+  // Waits for the reads in flight, which write into the buffers
+  ~csv_uring_source() {
+    while (num_in_flight > 0 && wait()) {}
+    if (sqes != MAP_FAILED) munmap(sqes, sqes_size);
+    if (cq_ring != MAP_FAILED && cq_ring != sq_ring) munmap(cq_ring, cq_ring_size);
+    if (sq_ring != MAP_FAILED) munmap(sq_ring, sq_ring_size);
+    if (ring_fd >= 0) close(ring_fd);
+    if (fd >= 0) close(fd);
+    for (buffer &b : buffers) std::free(b.chars);
+  }
+
+  // Open filename and start reading it, with O_DIRECT if direct and the file
+  // system supports it.  Return false if filename is not a regular file
+  // that can be opened, or if io_uring is not available.
+  bool open(const std::string &filename, bool direct) {
+    struct stat info;
+    if (stat(filename.c_str(), &info) != 0 || !S_ISREG(info.st_mode)) {
+      return false;
+    }
+    if (direct) fd = ::open(filename.c_str(), O_RDONLY | O_DIRECT);
+    if (fd < 0) fd = ::open(filename.c_str(), O_RDONLY);
+    if (fd < 0 || fstat(fd, &info) != 0 || !S_ISREG(info.st_mode)) {
+      return false;
+    }
+    file_size = static_cast<size_t>(info.st_size);
+
+    for (buffer &b : buffers) {
+      b.chars = static_cast<char *>(std::aligned_alloc(ALIGNMENT, BLOCK_LENGTH));
+      if (!b.chars) return false;
+    }
+    if (!setup()) return false;
+
+    for (size_t block=0; block<NUM_BUFFERS; ++block) {
+      read_block(block);
+    }
+    return true;
+  }
+
+  bool refill() override {
+    if (holding) {
+      // Read the block after the last one in flight into the buffer just
+      // parsed
+      holding = false;
+      read_block(next_block - 1 + NUM_BUFFERS);
+    }
+    if (next_block * BLOCK_LENGTH >= file_size) return false;
+
+    buffer &b = buffers[next_block % NUM_BUFFERS];
+    while (!b.done) {
+      if (!wait()) fail(errno);
+    }
+    if (b.error) fail(b.error);
+
+    // A file that shrank while being read ends early
+    if (b.filled == 0) return false;
+    next = b.chars;
+    end = next + b.filled;
+    next_block += 1;
+    holding = true;
+    return true;
+  }
+
+private:
+  static const size_t NUM_BUFFERS = 4;
+  static const size_t BLOCK_LENGTH = 1 << 20;
+
+  // O_DIRECT needs buffers aligned to the logical block size of the device
+  static const size_t ALIGNMENT = 4096;
+
+  struct buffer {
+    char *chars = nullptr;
+    struct iovec iov;
+    size_t block = 0;   // block being read into the buffer
+    size_t filled = 0;  // characters read so far
+    bool done = true;   // whether the read finished
+    int error = 0;      // errno of a failed read
+  };
+
+  // Create the ring, and map its queues.  Return false if io_uring is not
+  // available.
+  bool setup() {
+    struct io_uring_params params;
+    std::memset(&params, 0, sizeof(params));
+    ring_fd = static_cast<int>(syscall(__NR_io_uring_setup, NUM_BUFFERS, &params));
+    if (ring_fd < 0) return false;
+
+    sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    const bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single_mmap) {
+      sq_ring_size = cq_ring_size = std::max(sq_ring_size, cq_ring_size);
+    }
+    sq_ring = mmap(nullptr, sq_ring_size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+    if (sq_ring == MAP_FAILED) return false;
+    cq_ring = single_mmap ? sq_ring :
+      mmap(nullptr, cq_ring_size, PROT_READ | PROT_WRITE,
+           MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+    if (cq_ring == MAP_FAILED) return false;
+    sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+    sqes = mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) return false;
+
+    char *sq = static_cast<char *>(sq_ring);
+    sq_tail = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+    sq_mask = *reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+    sq_array = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+    char *cq = static_cast<char *>(cq_ring);
+    cq_head = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+    cq_tail = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+    cq_mask = *reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+    cqes = reinterpret_cast<io_uring_cqe *>(cq + params.cq_off.cqes);
+    return true;
+  }
+
+  // Start reading block into its buffer, if it is in the file
+  void read_block(size_t block) {
+    if (block * BLOCK_LENGTH >= file_size) return;
+    buffer &b = buffers[block % NUM_BUFFERS];
+    b.block = block;
+    b.filled = 0;
+    b.error = 0;
+    submit(block % NUM_BUFFERS);
+  }
+
+  // Queue a read of the rest of buffer i's block, and hand it to the kernel
+  void submit(size_t i) {
+    buffer &b = buffers[i];
+    b.done = false;
+    if (failed) {
+      // The queue may hold a read the kernel never took
+      b.done = true;
+      b.error = EIO;
+      return;
+    }
+    b.iov.iov_base = b.chars + b.filled;
+    b.iov.iov_len = BLOCK_LENGTH - b.filled;
+
+    const unsigned tail = *sq_tail;
+    const unsigned index = tail & sq_mask;
+    io_uring_sqe &sqe = static_cast<io_uring_sqe *>(sqes)[index];
+    std::memset(&sqe, 0, sizeof(sqe));
+    sqe.opcode = IORING_OP_READV;
+    sqe.fd = fd;
+    sqe.addr = reinterpret_cast<uint64_t>(&b.iov);
+    sqe.len = 1;
+    sqe.off = b.block * BLOCK_LENGTH + b.filled;
+    sqe.user_data = i;
+    sq_array[index] = index;
+    __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+    if (enter(1, 0, 0) < 0) {
+      failed = true;
+      b.done = true;
+      b.error = errno;
+      return;
+    }
+    num_in_flight += 1;
+  }
+
+  // Wait for at least one read to finish, and record every finished read.
+  // Return false, setting errno, if waiting fails.
+  bool wait() {
+    while (true) {
+      unsigned head = *cq_head;
+      const unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+      if (head != tail) {
+        for (; head != tail; ++head) {
+          const io_uring_cqe &cqe = cqes[head & cq_mask];
+          finish(static_cast<size_t>(cqe.user_data), cqe.res);
+        }
+        __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+        return true;
+      }
+      if (enter(0, 1, IORING_ENTER_GETEVENTS) < 0) return false;
+    }
+  }
+
+  // Record the result of a read into buffer i: a count of characters, or a
+  // negated errno.  A short read that is not at the end of the file is
+  // continued.
+  void finish(size_t i, int result) {
+    num_in_flight -= 1;
+    buffer &b = buffers[i];
+    if (result < 0) {
+      b.error = -result;
+    } else if (result > 0) {
+      b.filled += static_cast<size_t>(result);
+      const size_t left = file_size - b.block * BLOCK_LENGTH;
+      if (b.filled < (left < BLOCK_LENGTH ? left : BLOCK_LENGTH)) {
+        submit(i);
+        return;
+      }
+    }
+    b.done = true;
+  }
+
+  int enter(unsigned to_submit, unsigned min_complete, unsigned flags) {
+    while (true) {
+      const long result = syscall(__NR_io_uring_enter, ring_fd, to_submit,
+                                  min_complete, flags, nullptr, 0);
+      if (result >= 0 || errno != EINTR) return static_cast<int>(result);
+    }
+  }
+
+  // Throw csvstream_exception for a read that failed with error
+  [[noreturn]] static void fail(int error) {
+    throw csvstream_exception(std::string("Error reading file: ") +
+                              std::strerror(error));
+  }
+
+  int fd;
+  int ring_fd;
+  void *sq_ring;
+  void *cq_ring;
+  void *sqes;
+  size_t sq_ring_size;
+  size_t cq_ring_size;
+  size_t sqes_size;
+  unsigned *sq_tail;
+  unsigned sq_mask;
+  unsigned *sq_array;
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned cq_mask;
+  io_uring_cqe *cqes;
+
+  buffer buffers[NUM_BUFFERS];
+  size_t file_size;
+  size_t next_block;     // block refill() hands out next
+  size_t num_in_flight;  // reads the kernel has not finished
+  bool holding;          // whether the parser holds a buffer
+  bool failed;           // a read could not be handed to the kernel
+};
+#endif
+
+
+// Formats of compressed input, told apart by their first bytes
+enum csv_compression { CSV_PLAIN, CSV_GZIP, CSV_ZSTD };
+
+// Bytes csv_detect_compression() needs to tell every format apart
+const size_t CSV_MAGIC_LENGTH = 4;
+
+static csv_compression csv_detect_compression(const char *p, const char *end) {
+  static const unsigned char gzip_magic[] = {0x1f, 0x8b};
+  static const unsigned char zstd_magic[] = {0x28, 0xb5, 0x2f, 0xfd};
+  const size_t size = end - p;
+  if (size >= sizeof(gzip_magic) &&
+      std::memcmp(p, gzip_magic, sizeof(gzip_magic)) == 0) {
+    return CSV_GZIP;
+  }
+  if (size >= sizeof(zstd_magic) &&
+      std::memcmp(p, zstd_magic, sizeof(zstd_magic)) == 0) {
+    return CSV_ZSTD;
+  }
+  return CSV_PLAIN;
+}
+
+
+// Source that hands over the first bytes of another source, which were read
+// ahead of time to detect compression, and then the rest of that source.
+// Used when the first window of a source, such as a slow pipe, is too short
+// to tell the format from.
+class csv_peeked_source : public csv_source {
+public:
+  // rest must have handed over everything in peeked, and nothing more
+  csv_peeked_source(std::string peeked_in, std::unique_ptr<csv_source> rest)
+    : peeked(std::move(peeked_in)), rest(std::move(rest)), replaying(true) {
+    next = peeked.data();
+    end = next + peeked.size();
+  }
+
+  ~csv_peeked_source() {
+    if (!replaying) rest->next = next;
+  }
+
+  bool refill() override {
+    if (replaying) {
+      replaying = false;
+      if (rest->next == rest->end && !rest->refill()) return false;
+    } else {
+      rest->next = next;
+      if (!rest->refill()) return false;
+    }
+    next = rest->next;
+    end = rest->end;
+    return true;
+  }
+
+  void end_line() override {
+    if (replaying) return;
+    rest->next = next;
+    rest->end_line();
+  }
+
+private:
+  std::string peeked;
+  std::unique_ptr<csv_source> rest;
+  bool replaying;  // whether the window is still peeked
+};
+
+
+// Source that decompresses another source one block at a time.  decode()
+// turns the input window into at most a block of output, and refill() calls
+// it, taking more input as needed, until there is output or the input ends.
+class csv_decoder_source : public csv_source {
+public:
+  csv_decoder_source(std::unique_ptr<csv_source> input)
+    : input(std::move(input)), block(BLOCK_LENGTH), in_frame(false) {}
+
+  bool refill() override {
+    while (true) {
+      const size_t size = decode();
+      if (size > 0) {
+        next = block.data();
+        end = next + size;
+        return true;
+      }
+      if (input->next == input->end && !input->refill()) {
+        if (in_frame) throw csvstream_exception("Compressed input is truncated");
+        return false;
+      }
+    }
+  }
+
+protected:
+  static const size_t BLOCK_LENGTH = 1 << 18;
+
+  // Decompress from input->next into block, advancing input->next.  Set
+  // in_frame unless the input read so far ends with a whole frame or
+  // member.  Return the number of characters decompressed.
+  virtual size_t decode() = 0;
+
+  std::unique_ptr<csv_source> input;
+  std::vector<char> block;
+  bool in_frame;
+};
+
+
+#ifdef CSVSTREAM_ZLIB
+// Decoder for gzip, including files of several gzip members one after
+// another, like those written by pigz or by cat
+class csv_gzip_source : public csv_decoder_source {
+public:
+  csv_gzip_source(std::unique_ptr<csv_source> input)
+    : csv_decoder_source(std::move(input)) {
+    std::memset(&stream, 0, sizeof(stream));
+    // Window size 15, plus 16 for a gzip header and trailer
+    if (inflateInit2(&stream, 15 + 16) != Z_OK) {
+      throw csvstream_exception("Cannot start gzip decoder");
+    }
+  }
+
+  ~csv_gzip_source() {
+    inflateEnd(&stream);
+  }
+
+private:
+  size_t decode() override {
+    const size_t available = input->end - input->next;
+    stream.next_in =
+      reinterpret_cast<Bytef *>(const_cast<char *>(input->next));
+    stream.avail_in = static_cast<uInt>(
+      std::min<size_t>(available, std::numeric_limits<uInt>::max()));
+    stream.next_out = reinterpret_cast<Bytef *>(block.data());
+    stream.avail_out = static_cast<uInt>(block.size());
+    const int status = inflate(&stream, Z_NO_FLUSH);
+    input->next = reinterpret_cast<const char *>(stream.next_in);
+
+    if (status == Z_STREAM_END) {
+      // Another member may follow
+      inflateReset(&stream);
+      in_frame = false;
+    } else if (status == Z_OK) {
+      in_frame = true;
+    } else if (status != Z_BUF_ERROR) {
+      // Z_BUF_ERROR only means that no progress was possible
+      throw csvstream_exception(std::string("Corrupt gzip input: ") +
+                                (stream.msg ? stream.msg : "unknown error"));
+    }
+    return block.size() - stream.avail_out;
+  }
+
+  z_stream stream;
+};
+#endif
+
+
+#ifdef CSVSTREAM_ZSTD
+// Throw csvstream_exception if status, returned by libzstd, is an error
+static size_t csv_zstd_check(size_t status) {
+  if (ZSTD_isError(status)) {
+    throw csvstream_exception(std::string("Corrupt zstd input: ") +
+                              ZSTD_getErrorName(status));
+  }
+  return status;
+}
+
+
+// Decoder for zstd, one frame after another
+class csv_zstd_source : public csv_decoder_source {
+public:
+  csv_zstd_source(std::unique_ptr<csv_source> input)
+    : csv_decoder_source(std::move(input)), stream(ZSTD_createDStream()) {
+    if (!stream) throw csvstream_exception("Cannot start zstd decoder");
+    csv_zstd_check(ZSTD_initDStream(stream));
+  }
+
+  ~csv_zstd_source() {
+    ZSTD_freeDStream(stream);
+  }
+
+private:
+  size_t decode() override {
+    ZSTD_inBuffer in = {input->next, static_cast<size_t>(input->end - input->next), 0};
+    ZSTD_outBuffer out = {block.data(), block.size(), 0};
+    // Zero once a frame is complete and all of it has been output
+    const size_t status = csv_zstd_check(ZSTD_decompressStream(stream, &out, &in));
+    input->next += in.pos;
+    if (in.pos > 0 || out.pos > 0) in_frame = status != 0;
+    return out.pos;
+  }
+
+  ZSTD_DStream *stream;
+};
+
+
+// Source that decompresses the frames of a mapped zstd file on several
+// threads, a few frames ahead of the parser, and hands them out in order.
+// Each frame is decompressed whole, so it takes memory for its content.
+class csv_zstd_frames_source : public csv_source {
+public:
+  csv_zstd_frames_source(std::unique_ptr<csv_source> input, size_t num_threads)
+    : input(std::move(input)), max_ahead(2 * num_threads), next_decode(0),
+      next_take(0), holding(false), stopping(false) {
+    // Find where each frame ends, which only reads frame and block headers
+    const char *p = this->input->next;
+    const char *end = this->input->end;
+    while (p != end) {
+      const size_t size = csv_zstd_check(ZSTD_findFrameCompressedSize(p, end - p));
+      frames.push_back(frame{p, p + size, std::string(), false, nullptr});
+      p += size;
+    }
+    for (size_t i=0; i<num_threads; ++i) {
+      decoders.emplace_back(&csv_zstd_frames_source::decode, this);
+    }
+  }
+
+  // Waits for the frames being decoded to finish
+  ~csv_zstd_frames_source() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stopping = true;
+    }
+    changed.notify_all();
+    for (std::thread &decoder : decoders) {
+      decoder.join();
+    }
+  }
+
+  bool refill() override {
+    std::unique_lock<std::mutex> lock(mutex);
+    if (holding) {
+      // Free the frame just parsed, which lets a decoder start another
+      std::string().swap(frames[next_take - 1].text);
+      holding = false;
+      changed.notify_all();
+    }
+    while (next_take < frames.size()) {
+      frame &taken = frames[next_take++];
+      changed.notify_all();
+      changed.wait(lock, [&taken] { return taken.done; });
+      if (taken.error) std::rethrow_exception(taken.error);
+      if (taken.text.empty()) continue;
+      holding = true;
+      next = taken.text.data();
+      end = next + taken.text.size();
+      return true;
+    }
+    return false;
+  }
+
+private:
+  struct frame {
+    const char *begin;
+    const char *end;
+    std::string text;
+    bool done;
+    std::exception_ptr error;
+  };
+
+  // Body of each decoder thread: decode frames, in order, up to max_ahead
+  // frames ahead of the parser
+  void decode() {
+    ZSTD_DStream *stream = ZSTD_createDStream();
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+      changed.wait(lock, [this] {
+        return stopping || next_decode == frames.size() ||
+               next_decode < next_take + max_ahead;
+      });
+      if (stopping || next_decode == frames.size()) break;
+      frame &decoding = frames[next_decode++];
+      lock.unlock();
+
+      std::exception_ptr error;
+      try {
+        if (!stream) throw csvstream_exception("Cannot start zstd decoder");
+        decode_frame(stream, decoding);
+      } catch (...) {
+        error = std::current_exception();
+      }
+
+      lock.lock();
+      decoding.error = error;
+      decoding.done = true;
+      changed.notify_all();
+    }
+    lock.unlock();
+    ZSTD_freeDStream(stream);
+  }
+
+  // Decompress the whole of one frame into its text
+  static void decode_frame(ZSTD_DStream *stream, frame &decoding) {
+    csv_zstd_check(ZSTD_initDStream(stream));
+    const unsigned long long content_size =
+      ZSTD_getFrameContentSize(decoding.begin, decoding.end - decoding.begin);
+    const size_t step = ZSTD_DStreamOutSize();
+    if (content_size < std::numeric_limits<size_t>::max() - step) {
+      decoding.text.reserve(static_cast<size_t>(content_size) + step);
+    }
+
+    ZSTD_inBuffer in = {decoding.begin, static_cast<size_t>(decoding.end - decoding.begin), 0};
+    size_t filled = 0;
+    size_t status = 1;
+    while (status != 0) {
+      decoding.text.resize(filled + step);
+      ZSTD_outBuffer out = {&decoding.text[filled], step, 0};
+      status = csv_zstd_check(ZSTD_decompressStream(stream, &out, &in));
+      filled += out.pos;
+      if (status != 0 && in.pos == in.size && out.pos < step) {
+        throw csvstream_exception("Compressed input is truncated");
+      }
+    }
+    decoding.text.resize(filled);
+  }
+
+  std::unique_ptr<csv_source> input;
+  std::vector<frame> frames;
+  const size_t max_ahead;  // frames decoded before the parser needs them
+  size_t next_decode;      // frame a decoder takes next
+  size_t next_take;        // frame refill() takes next
+  bool holding;            // whether the parser holds a frame
+  bool stopping;           // the source is being destroyed
+  std::mutex mutex;
+  std::condition_variable changed;
+  std::vector<std::thread> decoders;
+};
+#endif
+
+
+// Return a pointer just past the line that starts at p, where read_csv_line()
+// would stop reading, without storing any fields.  Only quotes, backslashes
+// and line endings can end a line or hide a line ending, so the delimiter is
+// passed over by the scan unless it is itself a line ending character.
+static const char * csv_skip_line(const char *p,
+                                  const char *end,
+                                  char delimiter
+                                  ) {
+  bool quoted = false;
+  while (p != end) {
+    // Scanning with a double quote as the delimiter skips real delimiters
+    p = quoted ? csv_scan_quoted(p, end) : csv_scan_unquoted(p, end, '"');
+    if (p == end) break;
+
+    const char c = *p++;
+    if (c == '"') {
+      quoted = !quoted;
+    } else if (c == '\\') {
+      if (p == end) break;
+      ++p;
+    } else if (c != delimiter) {
+      // Line ending, and the second character of a Windows line ending
+      if (p != end && *p == '\n') ++p;
+      return p;
+    }
+  }
+  return end;
+}
+
+
+// A range of whole lines of a mapped file, and the rows parsed from it by
+// csvstream::read_parallel()
+struct csv_chunk {
+  // Position of the chunk in the file
+  size_t index;
+
+  // The chunk is [begin, end)
+  const char *begin;
+  const char *end;
+
+  // Line no of the line before the chunk
+  size_t line_no;
+
+  // Rows parsed from the chunk
+  std::vector<csvrow> rows;
+
+  // Rows kept from earlier chunks, to be reused
+  std::vector<csvrow> spare;
+
+  // Exception thrown while parsing or handling the chunk
+  std::exception_ptr error;
+};
+
+
+// Columnar cache file of every line of a CSV file, the header included.
+// The header below is followed by the number of fields in each line, then by
+// the offsets of each column, and then by the characters of every field.
+// Line i has row_sizes[i] fields, and field c of line i is the characters
+// [offsets[c][i], offsets[c][i + 1]) of the characters.  Lines with fewer
+// fields than the widest line have empty fields in the columns they lack.
+struct csv_cache_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t delimiter;
+
+  // The cache is out of date unless the CSV file still has this size and
+  // modification time
+  uint64_t source_size;
+  int64_t source_mtime_sec;
+  int64_t source_mtime_nsec;
+
+  uint64_t num_lines;
+  uint64_t num_columns;
+  uint64_t num_chars;
+};
+
+static const char CSV_CACHE_MAGIC[8] = {'C', 'S', 'V', 'C', 'A', 'C', 'H', 'E'};
+static const uint32_t CSV_CACHE_VERSION = 1;
+
+
+#ifdef CSVSTREAM_MMAP
+// Fill in the source fields of header from the stat of a CSV file
+static void csv_cache_stamp(csv_cache_header &header, const struct stat &info) {
+  header.source_size = static_cast<uint64_t>(info.st_size);
+  header.source_mtime_sec = static_cast<int64_t>(info.st_mtime);
+#ifdef __APPLE__
+  header.source_mtime_nsec = static_cast<int64_t>(info.st_mtimespec.tv_nsec);
+#else
+  header.source_mtime_nsec = static_cast<int64_t>(info.st_mtim.tv_nsec);
+#endif
+}
+#endif
+
+
+// Sink that collects lines, one column at a time, for a cache file.  Call
+// finish_line() after each line is read.
+class csv_cache_builder {
+public:
+  csv_cache_builder() : num_lines(0), field(0) {}
+
+  void start() {
+    field = 0;
+    if (columns.empty()) add_column();
+  }
+
+  void next_field() {
+    field += 1;
+    if (field == columns.size()) add_column();
+  }
+
+  void append(char c) {
+    columns[field] += c;
+  }
+
+  void append(const char *first, const char *last) {
+    columns[field].append(first, last);
+  }
+
+  // Add the line just read
+  void finish_line() {
+    row_sizes.push_back(field + 1);
+    for (size_t c=0; c<columns.size(); ++c) {
+      ends[c].push_back(columns[c].size());
+    }
+    num_lines += 1;
+  }
+
+  // Add a line that was read already
+  void add_line(const std::vector<std::string> &data) {
+    start();
+    for (size_t i=0; i<data.size(); ++i) {
+      if (i > 0) next_field();
+      append(data[i].data(), data[i].data() + data[i].size());
+    }
+    finish_line();
+  }
+
+#ifdef CSVSTREAM_MMAP
+  // Write the lines to a cache file called name for a CSV file with stat
+  // info.  Return false if it cannot be written.
+  bool write(const std::string &name, const struct stat &info,
+             char delimiter) const {
+    csv_cache_header header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, CSV_CACHE_MAGIC, sizeof(header.magic));
+    header.version = CSV_CACHE_VERSION;
+    header.delimiter = static_cast<unsigned char>(delimiter);
+    csv_cache_stamp(header, info);
+    header.num_lines = num_lines;
+    header.num_columns = columns.size();
+
+    // Offsets are into the characters of every column, one after another
+    std::vector<uint64_t> offsets;
+    offsets.reserve(columns.size() * (num_lines + 1));
+    for (size_t c=0; c<columns.size(); ++c) {
+      offsets.push_back(header.num_chars);
+      for (size_t i=0; i<num_lines; ++i) {
+        offsets.push_back(header.num_chars + ends[c][i]);
+      }
+      header.num_chars += columns[c].size();
+    }
+
+    // Write a temporary file and rename it, so that a reader never sees a
+    // partly written cache
+    const std::string temp_name = name + ".tmp";
+    std::ofstream out(temp_name.c_str(), std::ios::binary | std::ios::trunc);
+    out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    out.write(reinterpret_cast<const char *>(row_sizes.data()),
+              row_sizes.size() * sizeof(uint64_t));
+    out.write(reinterpret_cast<const char *>(offsets.data()),
+              offsets.size() * sizeof(uint64_t));
+    for (const std::string &column : columns) {
+      out.write(column.data(), column.size());
+    }
+    out.close();
+    if (!out || std::rename(temp_name.c_str(), name.c_str()) != 0) {
+      std::remove(temp_name.c_str());
+      return false;
+    }
+    return true;
+  }
+#endif
+
+private:
+  void add_column() {
+    // Lines so far have an empty field in the new column
+    columns.push_back(std::string());
+    ends.push_back(std::vector<uint64_t>(num_lines, 0));
+  }
+
+  size_t num_lines;
+  size_t field;                              // field being read
+  std::vector<uint64_t> row_sizes;           // fields in each line
+  std::vector<std::string> columns;          // characters of each column
+  std::vector<std::vector<uint64_t> > ends;  // end of each line in a column
+};
+
+
+// Memory-mapped cache file written by csv_cache_builder
+class csv_cache {
+public:
+  csv_cache() : base(nullptr), size(0), row_sizes(nullptr), offsets(nullptr),
+                chars(nullptr) {}
+
+  ~csv_cache() {
+#ifdef CSVSTREAM_MMAP
+    if (base) munmap(const_cast<char *>(base), size);
+#endif
+  }
+
+  // Map the cache file called name.  Return false, leaving nothing mapped,
+  // if it cannot be mapped, is damaged, or is out of date for a CSV file with
+  // stat info read with delimiter.
+  bool open(const std::string &name, const struct stat &info, char delimiter) {
+#ifdef CSVSTREAM_MMAP
+    const int fd = ::open(name.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+    struct stat cache_info;
+    void *mapping = MAP_FAILED;
+    if (fstat(fd, &cache_info) == 0 &&
+        cache_info.st_size >= static_cast<off_t>(sizeof(csv_cache_header))) {
+      mapping = mmap(nullptr, cache_info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if (mapping == MAP_FAILED) return false;
+    base = static_cast<const char *>(mapping);
+    size = cache_info.st_size;
+
+    if (!valid(info, delimiter)) {
+      munmap(mapping, size);
+      base = nullptr;
+      return false;
+    }
+    return true;
+#else
+    (void) name;
+    (void) info;
+    (void) delimiter;
+    return false;
+#endif
+  }
+
+  // Return the number of lines, the header included
+  size_t num_lines() const {
+    return header().num_lines;
+  }
+
+  // Hand the fields of line i to sink, as read_csv_line() would
+  template <typename Sink>
+  void read_line(size_t i, Sink &sink) const {
+    sink.start();
+    const size_t column_size = num_lines() + 1;
+    for (size_t c=0; c<row_sizes[i]; ++c) {
+      if (c > 0) sink.next_field();
+      const uint64_t *column = offsets + c * column_size;
+      sink.append(chars + column[i], chars + column[i + 1]);
+    }
+  }
+
+private:
+  const csv_cache_header &header() const {
+    return *reinterpret_cast<const csv_cache_header *>(base);
+  }
+
+#ifdef CSVSTREAM_MMAP
+  // Check the header, the size of the file, and every offset, so that
+  // reading a damaged cache cannot go out of bounds
+  bool valid(const struct stat &info, char delimiter) {
+    csv_cache_header expected;
+    std::memset(&expected, 0, sizeof(expected));
+    csv_cache_stamp(expected, info);
+    const csv_cache_header &actual = header();
+    if (std::memcmp(actual.magic, CSV_CACHE_MAGIC, sizeof(actual.magic)) != 0 ||
+        actual.version != CSV_CACHE_VERSION ||
+        actual.delimiter != static_cast<unsigned char>(delimiter) ||
+        actual.source_size != expected.source_size ||
+        actual.source_mtime_sec != expected.source_mtime_sec ||
+        actual.source_mtime_nsec != expected.source_mtime_nsec ||
+        actual.num_columns == 0) {
+      return false;
+    }
+
+    // Sizes are checked by division first, so that they cannot overflow
+    const uint64_t limit = size / sizeof(uint64_t);
+    if (actual.num_lines >= limit ||
+        actual.num_columns > limit / (actual.num_lines + 1)) {
+      return false;
+    }
+    const uint64_t num_offsets = actual.num_columns * (actual.num_lines + 1);
+    const uint64_t tables_size =
+      sizeof(csv_cache_header) + (actual.num_lines + num_offsets) * sizeof(uint64_t);
+    if (tables_size > size || actual.num_chars != size - tables_size) {
+      return false;
+    }
+
+    row_sizes = reinterpret_cast<const uint64_t *>(base + sizeof(csv_cache_header));
+    offsets = row_sizes + actual.num_lines;
+    chars = reinterpret_cast<const char *>(offsets + num_offsets);
+    for (uint64_t i=0; i<actual.num_lines; ++i) {
+      if (row_sizes[i] < 1 || row_sizes[i] > actual.num_columns) return false;
+    }
+    for (uint64_t i=0; i<num_offsets; ++i) {
+      if (offsets[i] > actual.num_chars) return false;
+      if (i % (actual.num_lines + 1) != 0 && offsets[i] < offsets[i - 1]) {
+        return false;
+      }
+    }
+    return true;
+  }
+#endif
+
+  const char *base;
+  size_t size;
+  const uint64_t *row_sizes;
+  const uint64_t *offsets;
+  const char *chars;
+};
+
+
+csvstream::csvstream(const std::string &filename, char delimiter, bool strict,
+                     unsigned flags)
   : filename(filename),
     is(fin),
     delimiter(delimiter),
     strict(strict),
-    line_no(0) {
-
-  // Open file
-  fin.open(filename.c_str());
-  if (!fin.is_open()) {
-    throw csvstream_exception("Error opening file: " + filename);
+    line_no(0),
+    num_selected(0),
+    map_begin(nullptr),
+    map_end(nullptr),
+    next_cached_line(0) {
+
+  // Read the cache if asked to, otherwise read through io_uring if asked to,
+  // otherwise map the file if possible, and otherwise open it as a stream
+  if ((flags & CSVSTREAM_CACHE) && open_cache(flags)) {
+    read_header();
+    return;
   }
+  if ((flags & CSVSTREAM_IO_URING) && open_uring(flags)) {
+    // source reads the file through io_uring
+  } else if (map_file(filename)) {
+    source.reset(new csv_source(map_begin, map_end));
+  } else if ((flags & CSVSTREAM_READ_AHEAD) && open_read_ahead(filename)) {
+    // source reads the file, such as a named pipe, on a background thread
+  } else {
+    fin.open(filename.c_str());
+    if (!fin.is_open()) {
+      throw csvstream_exception("Error opening file: " + filename);
+    }
+    open_stream(flags);
+  }
+  open_decoder(flags);
 
   // Process header
   read_header();
 }
 
 
-csvstream::csvstream(std::istream &is, char delimiter, bool strict)
+csvstream::csvstream(std::istream &is, char delimiter, bool strict,
+                     unsigned flags)
   : filename("[no filename]"),
     is(is),
     delimiter(delimiter),
     strict(strict),
-    line_no(0) {
+    line_no(0),
+    num_selected(0),
+    map_begin(nullptr),
+    map_end(nullptr),
+    next_cached_line(0) {
+  open_stream(flags);
+  open_decoder(flags);
   read_header();
 }
 
 
 csvstream::~csvstream() {
+  // Stop reading before closing what is read
+  source.reset();
   if (fin.is_open()) fin.close();
+#ifdef CSVSTREAM_MMAP
+  if (map_begin) munmap(const_cast<char *>(map_begin), map_end - map_begin);
+#endif
 }
 
 
@@ -248,7 +2059,8 @@ csvstream & csvstream::operator>> (std::map<std::string, std::string>& row) {
 
   // Read one line from stream, bail out if we're at the end
   std::vector<std::string> data;
-  if (!read_csv_line(is, data, delimiter)) return *this;
+  csv_all_fields sink(data);
+  if (!read_line(sink)) return *this;
   line_no += 1;
 
   // When strict mode is disabled, coerce the length of the data.  If data is
@@ -284,7 +2096,8 @@ csvstream & csvstream::operator>> (std::vector<std::pair<std::string, std::strin
 
   // Read one line from stream, bail out if we're at the end
   std::vector<std::string> data;
-  if (!read_csv_line(is, data, delimiter)) return *this;
+  csv_all_fields sink(data);
+  if (!read_line(sink)) return *this;
   line_no += 1;
 
   // When strict mode is disabled, coerce the length of the data.  If data is
@@ -313,9 +2126,512 @@ csvstream & csvstream::operator>> (std::vector<std::pair<std::string, std::strin
 }
 
 
+bool csvstream::map_file(const std::string &filename) {
+#ifdef CSVSTREAM_MMAP
+  // Only regular, nonempty files can be mapped.  Check before opening, since
+  // opening and closing a named pipe would drop its writer.
+  struct stat info;
+  if (stat(filename.c_str(), &info) != 0 || !S_ISREG(info.st_mode)) {
+    return false;
+  }
+  const int fd = open(filename.c_str(), O_RDONLY);
+  if (fd < 0) return false;
+
+  void *mapping = MAP_FAILED;
+  if (fstat(fd, &info) == 0 && S_ISREG(info.st_mode) && info.st_size > 0) {
+    mapping = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  }
+  close(fd);
+  if (mapping == MAP_FAILED) return false;
+
+  madvise(mapping, info.st_size, MADV_SEQUENTIAL);
+  map_begin = static_cast<const char *>(mapping);
+  map_end = map_begin + info.st_size;
+  return true;
+#else
+  (void) filename;
+  return false;
+#endif
+}
+
+
+void csvstream::open_stream(unsigned flags) {
+  // Parse out of the stream's buffer where it has one.  Otherwise read one
+  // character at a time.
+  if (flags & CSVSTREAM_READ_AHEAD) {
+    source.reset(new csv_read_ahead_source(is.rdbuf()));
+  } else if (is && csv_streambuf_source::buffered(is)) {
+    source.reset(new csv_streambuf_source(is));
+  }
+}
+
+
+bool csvstream::open_read_ahead(const std::string &filename) {
+#ifdef CSVSTREAM_MMAP
+  const int fd = open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) return false;
+  source.reset(new csv_read_ahead_source(nullptr, fd));
+  return true;
+#else
+  (void) filename;
+  return false;
+#endif
+}
+
+
+bool csvstream::open_uring(unsigned flags) {
+#ifdef CSVSTREAM_URING
+  std::unique_ptr<csv_uring_source> uring(new csv_uring_source());
+  if (!uring->open(filename, flags & CSVSTREAM_DIRECT_IO)) return false;
+  source.reset(uring.release());
+  return true;
+#else
+  (void) flags;
+  return false;
+#endif
+}
+
+
+void csvstream::open_decoder(unsigned flags) {
+  if (!source) return;
+  if (source->next == source->end && !source->refill()) return;
+
+  // A source that is read as it arrives may hand over fewer bytes than the
+  // format is told apart by.  Gather at least that many first, unless the
+  // input ends sooner, and hand them to the parser or the decoder ahead of
+  // the rest.  A mapped file is always whole.
+  bool whole = false;
+#ifdef CSVSTREAM_MMAP
+  whole = map_begin != nullptr;
+#endif
+  if (!whole &&
+      static_cast<size_t>(source->end - source->next) < CSV_MAGIC_LENGTH) {
+    std::string peeked;
+    do {
+      peeked.append(source->next, source->end);
+      source->next = source->end;
+    } while (peeked.size() < CSV_MAGIC_LENGTH && source->refill());
+    source.reset(new csv_peeked_source(std::move(peeked), std::move(source)));
+  }
+
+  const csv_compression compression =
+    csv_detect_compression(source->next, source->end);
+  if (compression == CSV_PLAIN) return;
+
+  // The decoder owns what it reads.  Its output cannot be split by
+  // read_parallel(), so the file no longer counts as mapped.
+  std::unique_ptr<csv_source> input;
+#ifdef CSVSTREAM_MMAP
+  if (map_begin) {
+    input.reset(new csv_mapped_source(map_begin, map_end));
+    map_begin = map_end = nullptr;
+    source.reset();
+  }
+#endif
+  const bool mapped = static_cast<bool>(input);
+  if (!mapped) input.swap(source);
+
+  if (compression == CSV_GZIP) {
+#ifdef CSVSTREAM_ZLIB
+    source.reset(new csv_gzip_source(std::move(input)));
+    return;
+#else
+    throw csvstream_exception("Reading gzip input needs CSVSTREAM_ZLIB: " +
+                              filename);
+#endif
+  }
+
+#ifdef CSVSTREAM_ZSTD
+  const size_t num_threads = std::thread::hardware_concurrency();
+  if (mapped && (flags & CSVSTREAM_PARALLEL_DECODE) && num_threads > 1) {
+    source.reset(new csv_zstd_frames_source(std::move(input), num_threads));
+  } else {
+    source.reset(new csv_zstd_source(std::move(input)));
+  }
+#else
+  (void) flags;
+  (void) mapped;
+  throw csvstream_exception("Reading zstd input needs CSVSTREAM_ZSTD: " +
+                            filename);
+#endif
+}
+
+
+bool csvstream::open_cache(unsigned flags) {
+#ifdef CSVSTREAM_MMAP
+  struct stat info;
+  if (stat(filename.c_str(), &info) != 0 || !S_ISREG(info.st_mode)) {
+    return false;
+  }
+  const std::string cache_name = filename + ".csvcache";
+  std::unique_ptr<csv_cache> opened(new csv_cache());
+  if (!opened->open(cache_name, info, delimiter)) {
+    // Parse every line of the file, as reading it without a cache would,
+    // and save them.  Lines are saved whatever their length, so that strict
+    // mode is checked as they are read from the cache.
+    csvstream csv(filename, delimiter, strict,
+                  flags & ~static_cast<unsigned>(CSVSTREAM_CACHE));
+    csv_cache_builder builder;
+    builder.add_line(csv.header);
+    while (csv.read_line(builder)) {
+      builder.finish_line();
+    }
+    if (!builder.write(cache_name, info, delimiter) ||
+        !opened->open(cache_name, info, delimiter)) {
+      return false;
+    }
+  }
+  cache.swap(opened);
+  next_cached_line = 0;
+  return true;
+#else
+  (void) flags;
+  return false;
+#endif
+}
+
+
+template <typename Sink>
+bool csvstream::read_line(Sink &sink) {
+  if (!source && !cache) return read_csv_line(is, sink, delimiter);
+
+  // Set the same error flags reading is would, so that operator bool works
+  // the same for every source
+  if (!is) {
+    sink.start();
+    is.setstate(std::ios_base::failbit);
+    return false;
+  }
+  if (cache) {
+    if (next_cached_line < cache->num_lines()) {
+      cache->read_line(next_cached_line++, sink);
+      return true;
+    }
+    sink.start();
+  } else if (read_csv_line(*source, sink, delimiter)) {
+    source->end_line();
+    return true;
+  }
+  is.setstate(std::ios_base::eofbit | std::ios_base::failbit);
+  return false;
+}
+
+
+void csvstream::select_columns(const std::vector<std::string> &names) {
+  std::vector<size_t> indices;
+  for (const std::string &name : names) {
+    size_t i = 0;
+    while (i < header.size() && header[i] != name) ++i;
+    if (i == header.size()) {
+      throw csvstream_exception("Column not in header: " + name + " " +
+                                filename);
+    }
+    indices.push_back(i);
+  }
+  select_column_indices(indices);
+}
+
+
+void csvstream::select_column_indices(const std::vector<size_t> &indices) {
+  std::vector<int> slots(header.size(), -1);
+  for (size_t slot=0; slot<indices.size(); ++slot) {
+    if (indices[slot] >= header.size()) {
+      throw csvstream_exception("Column index out of range: " +
+                                std::to_string(indices[slot]) + " " + filename);
+    }
+    if (slots[indices[slot]] != -1) {
+      throw csvstream_exception("Column selected more than once: " +
+                                std::to_string(indices[slot]) + " " + filename);
+    }
+    slots[indices[slot]] = static_cast<int>(slot);
+  }
+  selected_slots.swap(slots);
+  num_selected = indices.size();
+}
+
+
+csvstream & csvstream::operator>> (csvrow& row) {
+  // Read one line from stream, bail out if we're at the end
+  const bool selected = !selected_slots.empty();
+  csv_row_fields sink(row, selected ? &selected_slots : nullptr, num_selected);
+  if (!read_line(sink)) return *this;
+  line_no += 1;
+
+  // When strict mode is disabled, coerce the length of the data.  If data is
+  // larger than header, discard extra values.  If data is smaller than header,
+  // pad data with empty strings.
+  if (!strict) {
+    sink.resize(header.size());
+  } else if (sink.row_size() != header.size()) {
+    throw_row_size_error(line_no, sink.row_size());
+  }
+
+  return *this;
+}
+
+
+template <size_t N>
+csvstream & csvstream::operator>> (std::array<std::string, N>& fields) {
+  if (N != num_selected) {
+    throw csvstream_exception("Array size does not match selected columns. "
+                              "N = " + std::to_string(N) + " " +
+                              "selected = " + std::to_string(num_selected));
+  }
+
+  // Read one line from stream, bail out if we're at the end.  Unselected
+  // columns are counted but never copied.  When strict mode is disabled,
+  // missing values are left empty and extra values are ignored.
+  csv_selected_fields sink(selected_slots, fields.data(), N);
+  if (!read_line(sink)) return *this;
+  line_no += 1;
+
+  // Check length of data
+  if (strict && sink.row_size() != header.size()) {
+    throw_row_size_error(line_no, sink.row_size());
+  }
+
+  return *this;
+}
+
+
+template <typename Record, auto... Members>
+csvstream & csvstream::operator>> (csvrecord<Record, Members...>& record) {
+  typedef csvrecord<Record, Members...> record_type;
+  if (record_type::size != num_selected) {
+    throw csvstream_exception("Record size does not match selected columns. "
+                              "size = " + std::to_string(record_type::size) +
+                              " selected = " + std::to_string(num_selected));
+  }
+
+  // Read one line from stream, bail out if we're at the end
+  if (*this >> record.fields) {
+    record_type::decode(record.fields, record);
+  }
+  return *this;
+}
+
+
+void csvstream::read_parallel(size_t num_threads,
+                              bool ordered,
+                              const chunk_handler &handle,
+                              size_t chunk_size) {
+  if (num_threads < 1) num_threads = 1;
+  if (chunk_size < 1) chunk_size = 1;
+
+  // Input that is not mapped cannot be split, so read it here in batches of
+  // about chunk_size characters
+  if (!map_begin) {
+    std::vector<csvrow> rows(1);
+    size_t num_chunks = 0;
+    size_t batch_size = 0;
+    while (*this >> rows.back()) {
+      for (size_t i=0; i<rows.back().size(); ++i) {
+        batch_size += rows.back()[i].size() + 1;
+      }
+      if (batch_size >= chunk_size) {
+        handle(num_chunks++, rows);
+        rows.resize(1);
+        batch_size = 0;
+      } else {
+        rows.emplace_back();
+      }
+    }
+    rows.pop_back();
+    if (!rows.empty()) handle(num_chunks, rows);
+    return;
+  }
+
+  // One thread scans the file for line boundaries and hands chunks to the
+  // parsing threads.  At most max_chunks chunks are in flight at once, and
+  // their buffers are recycled.
+  std::mutex mutex;
+  std::condition_variable changed;
+  std::vector<std::unique_ptr<csv_chunk> > chunks;
+  std::vector<csv_chunk *> free_chunks;
+  std::deque<csv_chunk *> scanned;
+  std::map<size_t, csv_chunk *> parsed;
+  const size_t max_chunks = 4 * num_threads;
+  size_t num_chunks = 0;
+  bool scan_done = false;
+  size_t end_line_no = line_no;
+
+  // First exception in file order.  Stops every thread once set.
+  std::exception_ptr error;
+  size_t error_index = 0;
+  auto fail = [&](csv_chunk *chunk) {
+    if (!error || chunk->index < error_index) {
+      error = chunk->error;
+      error_index = chunk->index;
+    }
+    changed.notify_all();
+  };
+  auto recycle = [&](csv_chunk *chunk) {
+    if (chunk->error) fail(chunk);
+    free_chunks.push_back(chunk);
+    changed.notify_all();
+  };
+
+  std::thread scanner([&] {
+    const char *p = source->next;
+    size_t line = line_no;
+    while (p != map_end) {
+      std::unique_lock<std::mutex> lock(mutex);
+      changed.wait(lock, [&] {
+        return error || !free_chunks.empty() || chunks.size() < max_chunks;
+      });
+      if (error) break;
+      if (free_chunks.empty()) {
+        chunks.emplace_back(new csv_chunk());
+        free_chunks.push_back(chunks.back().get());
+      }
+      csv_chunk *chunk = free_chunks.back();
+      free_chunks.pop_back();
+      lock.unlock();
+
+      chunk->index = num_chunks;
+      chunk->begin = p;
+      chunk->line_no = line;
+      chunk->error = nullptr;
+      const char *target = p + std::min<size_t>(chunk_size, map_end - p);
+      while (p < target) {
+        p = csv_skip_line(p, map_end, delimiter);
+        line += 1;
+      }
+      chunk->end = p;
+
+      lock.lock();
+      scanned.push_back(chunk);
+      num_chunks += 1;
+      changed.notify_all();
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    scan_done = true;
+    end_line_no = line;
+    changed.notify_all();
+  });
+
+  std::vector<std::thread> parsers;
+  for (size_t i=0; i<num_threads; ++i) {
+    parsers.emplace_back([&] {
+      std::unique_lock<std::mutex> lock(mutex);
+      while (true) {
+        changed.wait(lock, [&] {
+          return error || !scanned.empty() || scan_done;
+        });
+        if (error || scanned.empty()) break;
+        csv_chunk *chunk = scanned.front();
+        scanned.pop_front();
+        lock.unlock();
+
+        try {
+          parse_chunk(*chunk);
+          if (!ordered) handle(chunk->index, chunk->rows);
+        } catch (...) {
+          chunk->error = std::current_exception();
+        }
+
+        lock.lock();
+        if (ordered) {
+          parsed[chunk->index] = chunk;
+          changed.notify_all();
+        } else {
+          recycle(chunk);
+        }
+      }
+    });
+  }
+
+  // Hand ordered chunks over as soon as every chunk before them is done
+  if (ordered) {
+    std::unique_lock<std::mutex> lock(mutex);
+    for (size_t next=0; ; ++next) {
+      changed.wait(lock, [&] {
+        return error || parsed.count(next) || (scan_done && next == num_chunks);
+      });
+      if (error || !parsed.count(next)) break;
+      csv_chunk *chunk = parsed[next];
+      parsed.erase(next);
+      lock.unlock();
+
+      if (!chunk->error) {
+        try {
+          handle(chunk->index, chunk->rows);
+        } catch (...) {
+          chunk->error = std::current_exception();
+        }
+      }
+
+      lock.lock();
+      recycle(chunk);
+    }
+  }
+
+  scanner.join();
+  for (std::thread &parser : parsers) {
+    parser.join();
+  }
+
+  // Every row has been read, just as if by operator>>
+  source->next = source->end;
+  line_no = end_line_no;
+  is.setstate(std::ios_base::eofbit | std::ios_base::failbit);
+  if (error) std::rethrow_exception(error);
+}
+
+
+void csvstream::parse_chunk(csv_chunk &chunk) const {
+  const bool selected = !selected_slots.empty();
+  const char *p = chunk.begin;
+  size_t line = chunk.line_no;
+  size_t num_rows = 0;
+  while (p != chunk.end) {
+    // Reuse a row from an earlier chunk if there is one
+    if (num_rows == chunk.rows.size()) {
+      if (chunk.spare.empty()) {
+        chunk.rows.emplace_back();
+      } else {
+        chunk.rows.push_back(std::move(chunk.spare.back()));
+        chunk.spare.pop_back();
+      }
+    }
+    csv_row_fields sink(chunk.rows[num_rows], selected ? &selected_slots : nullptr,
+                        num_selected);
+    csv_source lines(p, chunk.end);
+    read_csv_line(lines, sink, delimiter);
+    p = lines.next;
+    line += 1;
+    num_rows += 1;
+
+    // Same length checks as operator>>(csvrow)
+    if (!strict) {
+      sink.resize(header.size());
+    } else if (sink.row_size() != header.size()) {
+      throw_row_size_error(line, sink.row_size());
+    }
+  }
+
+  // Keep the buffers of rows this chunk did not need
+  while (chunk.rows.size() > num_rows) {
+    chunk.spare.push_back(std::move(chunk.rows.back()));
+    chunk.rows.pop_back();
+  }
+}
+
+
+void csvstream::throw_row_size_error(size_t line, size_t row_size) const {
+  auto msg = "Number of items in row does not match header. " +
+    filename + ":L" + std::to_string(line) + " " +
+    "header.size() = " + std::to_string(header.size()) + " " +
+    "row.size() = " + std::to_string(row_size) + " "
+    ;
+  throw csvstream_exception(msg);
+}
+
+
 void csvstream::read_header() {
   // read first line, which is the header
-  if (!read_csv_line(is, header, delimiter)) {
+  csv_all_fields sink(header);
+  if (!read_line(sink)) {
     throw csvstream_exception("error reading header");
   }
 }
@@ -1,204 +1,1908 @@
 #include <iostream>
+#include <sstream>
 #include "csvstream.h"
 #include <map>
-#include <set>
 #include <string>
+#include <string_view>
+#include <deque>
+#include <unordered_map>
 #include <vector>
 #include <utility>
+#include <algorithm>
 #include <cmath>
+#include <cstdlib>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <memory>
+#include <fstream>
+#include <cstdint>
+#include <climits>
+#include <cstring>
+#include <exception>
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define MODEL_FILES_MMAP 1
+#endif
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define SCORE_KERNELS_X86 1
+#endif
 
 using namespace std;
 
 
+// Rows of the scoring table are padded to a multiple of this many labels, the
+// width of one AVX-512 vector of doubles, so the kernels below never need a
+// remainder loop.
+const int SCORE_LANES = 8;
+
+// Every kernel adds rows into each lane in the same order with plain IEEE
+// additions, so all of them produce bit-identical scores.
+
+// REQUIRES: width is a multiple of SCORE_LANES
+// MODIFIES: scores
+// EFFECTS: Adds rows row_ids[0], ..., row_ids[num_rows - 1] of table, each
+// width doubles long, into scores.
+static void add_score_rows_scalar(double *scores, const double *table, const int *row_ids,
+                                  size_t num_rows, size_t width) {
+    for (size_t block = 0; block < width; block += SCORE_LANES) {
+        double sums[SCORE_LANES];
+        copy_n(scores + block, SCORE_LANES, sums);
+        for (size_t i = 0; i < num_rows; ++i) {
+            const double *row = table + row_ids[i] * width + block;
+            for (int lane = 0; lane < SCORE_LANES; ++lane) {
+                sums[lane] += row[lane];
+            }
+        }
+        copy_n(sums, SCORE_LANES, scores + block);
+    }
+}
+
+// REQUIRES: width is a positive multiple of SCORE_LANES
+// EFFECTS: Returns the index of the greatest score.  Ties go to the greatest
+// index, which is the lexicographically greatest label because the table's
+// columns are sorted by label.
+static int max_score_index_scalar(const double *scores, size_t width) {
+    size_t best = 0;
+    for (size_t i = 1; i < width; ++i) {
+        if (scores[i] >= scores[best]) {
+            best = i;
+        }
+    }
+    return static_cast<int>(best);
+}
+
+#ifdef SCORE_KERNELS_X86
+__attribute__((target("avx2")))
+static void add_score_rows_avx2(double *scores, const double *table, const int *row_ids,
+                                size_t num_rows, size_t width) {
+    for (size_t block = 0; block < width; block += SCORE_LANES) {
+        __m256d low = _mm256_loadu_pd(scores + block);
+        __m256d high = _mm256_loadu_pd(scores + block + 4);
+        for (size_t i = 0; i < num_rows; ++i) {
+            const double *row = table + row_ids[i] * width + block;
+            low = _mm256_add_pd(low, _mm256_loadu_pd(row));
+            high = _mm256_add_pd(high, _mm256_loadu_pd(row + 4));
+        }
+        _mm256_storeu_pd(scores + block, low);
+        _mm256_storeu_pd(scores + block + 4, high);
+    }
+}
+
+__attribute__((target("avx2")))
+static int max_score_index_avx2(const double *scores, size_t width) {
+    __m256d max_scores = _mm256_loadu_pd(scores);
+    for (size_t i = 4; i < width; i += 4) {
+        max_scores = _mm256_max_pd(max_scores, _mm256_loadu_pd(scores + i));
+    }
+    double lanes[4];
+    _mm256_storeu_pd(lanes, max_scores);
+    const __m256d best = _mm256_set1_pd(max(max(lanes[0], lanes[1]), max(lanes[2], lanes[3])));
+
+    // Search from the back so the last index holding the maximum wins.
+    for (size_t i = width; i > 0; i -= 4) {
+        const int mask = _mm256_movemask_pd(_mm256_cmp_pd(_mm256_loadu_pd(scores + i - 4), best, _CMP_EQ_OQ));
+        if (mask) {
+            return static_cast<int>(i - 4) + 31 - __builtin_clz(mask);
+        }
+    }
+    return max_score_index_scalar(scores, width);
+}
+
+__attribute__((target("avx512f")))
+static void add_score_rows_avx512(double *scores, const double *table, const int *row_ids,
+                                  size_t num_rows, size_t width) {
+    for (size_t block = 0; block < width; block += SCORE_LANES) {
+        __m512d sums = _mm512_loadu_pd(scores + block);
+        for (size_t i = 0; i < num_rows; ++i) {
+            sums = _mm512_add_pd(sums, _mm512_loadu_pd(table + row_ids[i] * width + block));
+        }
+        _mm512_storeu_pd(scores + block, sums);
+    }
+}
+
+__attribute__((target("avx512f")))
+static int max_score_index_avx512(const double *scores, size_t width) {
+    // The masked forms avoid the undefined source operand of _mm512_max_pd,
+    // which trips -Wmaybe-uninitialized on some GCC releases.
+    __m512d max_scores = _mm512_loadu_pd(scores);
+    for (size_t i = SCORE_LANES; i < width; i += SCORE_LANES) {
+        max_scores = _mm512_mask_max_pd(max_scores, 0xFF, max_scores, _mm512_loadu_pd(scores + i));
+    }
+    double lanes[SCORE_LANES];
+    _mm512_storeu_pd(lanes, max_scores);
+    const __m512d best = _mm512_set1_pd(*max_element(lanes, lanes + SCORE_LANES));
+
+    // Search from the back so the last index holding the maximum wins.
+    for (size_t i = width; i > 0; i -= SCORE_LANES) {
+        const unsigned mask = _mm512_cmp_pd_mask(_mm512_loadu_pd(scores + i - SCORE_LANES), best, _CMP_EQ_OQ);
+        if (mask) {
+            return static_cast<int>(i - SCORE_LANES) + 31 - __builtin_clz(mask);
+        }
+    }
+    return max_score_index_scalar(scores, width);
+}
+#endif
+
+// The scoring kernels used by Classifier, chosen once at startup for the
+// widest vector unit the CPU supports.
+struct ScoreKernels {
+    void (*add_score_rows)(double *, const double *, const int *, size_t, size_t);
+    int (*max_score_index)(const double *, size_t);
+};
+
+static ScoreKernels select_score_kernels() {
+#ifdef SCORE_KERNELS_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) {
+        return {add_score_rows_avx512, max_score_index_avx512};
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        return {add_score_rows_avx2, max_score_index_avx2};
+    }
+#endif
+    return {add_score_rows_scalar, max_score_index_scalar};
+}
+
+static const ScoreKernels score_kernels = select_score_kernels();
+
+
+// The characters isspace() accepts in the "C" locale, which are the ones
+// istringstream >> string splits words on.
+struct WordSeparators {
+    bool table[256];
+
+    constexpr WordSeparators() : table() {
+        table[static_cast<unsigned char>(' ')] = true;
+        table[static_cast<unsigned char>('\t')] = true;
+        table[static_cast<unsigned char>('\n')] = true;
+        table[static_cast<unsigned char>('\v')] = true;
+        table[static_cast<unsigned char>('\f')] = true;
+        table[static_cast<unsigned char>('\r')] = true;
+    }
+
+    bool operator()(char c) const {
+        return table[static_cast<unsigned char>(c)];
+    }
+};
+
+static constexpr WordSeparators is_word_separator;
+
+// MODIFIES: words
+// EFFECTS: Replaces words with the whitespace delimited words of text, in
+// order, as views into text.  Splits exactly where istringstream >> string
+// would, without copying or allocating beyond the capacity of words.
+static void split_words(string_view text, vector<string_view> &words) {
+    words.clear();
+    const char *const end = text.data() + text.size();
+    const char *next = text.data();
+    while (true) {
+        while (next != end && is_word_separator(*next)) {
+            ++next;
+        }
+        if (next == end) {
+            return;
+        }
+        const char *const word = next;
+        while (next != end && !is_word_separator(*next)) {
+            ++next;
+        }
+        words.emplace_back(word, next - word);
+    }
+}
+
+// EFFECTS: Returns the 64-bit FNV-1a hash of word.  Model files store a hash
+// table, so this must not change between versions.
+static uint64_t hash_word(string_view word) {
+    uint64_t hash = 14695981039346656037ull;
+    for (const char c : word) {
+        hash = (hash ^ static_cast<unsigned char>(c)) * 1099511628211ull;
+    }
+    return hash;
+}
+
+// Posts with at most this many words are deduplicated with a WordSet.  Longer
+// posts are deduplicated by sorting the ids of their words, which is cheaper
+// than comparing the words themselves.
+const size_t SMALL_POST_WORDS = 64;
+
+// A small open-addressing set of words, reused from one post to the next.
+// Each slot records the generation it was filled in, so clear() only has to
+// start a new generation instead of touching every slot.
+class WordSet {
+    public:
+        WordSet() : slots(2 * SMALL_POST_WORDS), generation(0) {}
+
+        // MODIFIES: this
+        // EFFECTS: Empties the set.
+        void clear() {
+            if (++generation == 0) {
+                slots.assign(slots.size(), Slot());
+                generation = 1;
+            }
+        }
+
+        // REQUIRES: fewer than SMALL_POST_WORDS words were inserted since the
+        //           last clear(), and the words inserted since are still alive
+        // MODIFIES: this
+        // EFFECTS: Adds word to the set.  Returns true if it was not already
+        // in the set.
+        bool insert(string_view word) {
+            const size_t mask = slots.size() - 1;
+            for (size_t slot = hash_word(word) & mask; ; slot = (slot + 1) & mask) {
+                if (slots[slot].generation != generation) {
+                    slots[slot].word = word;
+                    slots[slot].generation = generation;
+                    return true;
+                }
+                if (slots[slot].word == word) {
+                    return false;
+                }
+            }
+        }
+
+    private:
+        struct Slot {
+            Slot() : generation(0) {}
+            string_view word;
+            unsigned generation; // the set holds word only in this generation
+        };
+
+        vector<Slot> slots; // a power of two, at least twice SMALL_POST_WORDS
+        unsigned generation;
+};
+
+// REQUIRES: words.size() <= SMALL_POST_WORDS
+// MODIFIES: words, seen
+// EFFECTS: Removes every repeat of a word from words, keeping the first
+// occurrence of each word in its place.
+static void remove_repeated_words(vector<string_view> &words, WordSet &seen) {
+    seen.clear();
+    size_t num_unique = 0;
+    for (const string_view word : words) {
+        if (seen.insert(word)) {
+            words[num_unique++] = word;
+        }
+    }
+    words.resize(num_unique);
+}
+
+// MODIFIES: words, seen
+// EFFECTS: Replaces words with its unique words, in lexicographic order.
+static void sort_unique_words(vector<string_view> &words, WordSet &seen) {
+    if (words.size() > SMALL_POST_WORDS) {
+        sort(words.begin(), words.end());
+        words.erase(unique(words.begin(), words.end()), words.end());
+    } else {
+        remove_repeated_words(words, seen);
+        sort(words.begin(), words.end());
+    }
+}
+
+
+// Interns strings, giving each distinct string a dense integer id in order of
+// first appearance.  Ids index directly into the Classifier's count tables.
+class Vocabulary {
+    public:
+        Vocabulary() {}
+
+        // Moving a deque keeps its strings where they are, so the keys in ids
+        // stay valid.
+        Vocabulary(Vocabulary &&) = default;
+        Vocabulary &operator=(Vocabulary &&) = default;
+
+        // MODIFIES: words, ids
+        // EFFECTS: Returns the id of word, assigning it the next free id if
+        // word has not been seen before.
+        int intern(string_view word) {
+            auto found = ids.find(word);
+            if (found != ids.end()) {
+                return found->second;
+            }
+            words.emplace_back(word);
+            const int id = static_cast<int>(words.size()) - 1;
+            ids.emplace(words.back(), id);
+            return id;
+        }
+
+        // EFFECTS: Returns the id of word, or -1 if word has not been interned.
+        int find(string_view word) const {
+            auto found = ids.find(word);
+            return found == ids.end() ? -1 : found->second;
+        }
+
+        // REQUIRES: 0 <= id < size()
+        // EFFECTS: Returns the string with the given id.
+        const string &word(int id) const {
+            return words[id];
+        }
+
+        // EFFECTS: Returns the number of interned strings.
+        int size() const {
+            return static_cast<int>(words.size());
+        }
+
+        // EFFECTS: Returns every id, ordered by the lexicographic order of
+        // their strings.
+        vector<int> sorted_ids() const {
+            vector<int> order(words.size());
+            for (size_t i = 0; i < order.size(); ++i) {
+                order[i] = static_cast<int>(i);
+            }
+            sort(order.begin(), order.end(), [this](int lhs, int rhs) {
+                return words[lhs] < words[rhs];
+            });
+            return order;
+        }
+
+    private:
+        // A deque never moves its elements, so the string_view keys in ids
+        // stay valid as words grows.
+        deque<string> words;
+        unordered_map<string_view, int> ids;
+
+        // Disable copying, a copy of ids would still point into the original
+        // words
+        Vocabulary(const Vocabulary &);
+        Vocabulary &operator=(const Vocabulary &);
+};
+
+
+// The counts a Classifier is trained on: the number of posts with each label,
+// with each word, and with each word under each label.  Words and labels are
+// interned, and the (label, word) counts live in one label-major table.
+// Sparse counts, used for the shards of parallel training, instead keep only
+// the nonzero (label, word) counts, in a hash table, so that a shard costs
+// memory in proportion to what it has seen rather than to labels times words.
+class TrainingCounts {
+    public:
+        explicit TrainingCounts(bool sparse_in = false)
+            : num_training_posts(0), word_stride(0), sparse(sparse_in) {}
+
+        // MODIFIES: this
+        // EFFECTS: Counts one post with the given label and words.  A word
+        // that appears in the post more than once is counted once.
+        void add_post(string_view label, const vector<string_view> &words_in_post) {
+            const int label_id = intern_label(label);
+            if (words_in_post.size() <= SMALL_POST_WORDS) {
+                post_words.clear();
+                for (const string_view word : words_in_post) {
+                    if (post_words.insert(word)) {
+                        add_word(label_id, intern_word(word));
+                    }
+                }
+            } else {
+                post_word_ids.clear();
+                for (const string_view word : words_in_post) {
+                    post_word_ids.push_back(intern_word(word));
+                }
+                sort(post_word_ids.begin(), post_word_ids.end());
+                post_word_ids.erase(unique(post_word_ids.begin(), post_word_ids.end()), post_word_ids.end());
+                for (const int word_id : post_word_ids) {
+                    add_word(label_id, word_id);
+                }
+            }
+            posts_with_label[label_id]++;
+            num_training_posts += 1;
+        }
+
+        // REQUIRES: this is not sparse
+        // MODIFIES: this
+        // EFFECTS: Adds every count in other to this.  Labels and words that
+        // are new to this are interned in other's id order, so merging the
+        // same tables in the same order always assigns the same ids.  Only
+        // the nonzero (label, word) counts of sparse counts are visited.
+        void merge(const TrainingCounts &other) {
+            vector<int> label_ids(other.labels().size());
+            for (int label = 0; label < other.labels().size(); ++label) {
+                label_ids[label] = intern_label(other.labels().word(label));
+                posts_with_label[label_ids[label]] += other.num_posts_with_label(label);
+            }
+            vector<int> word_ids(other.vocabulary().size());
+            for (int word = 0; word < other.vocabulary().size(); ++word) {
+                word_ids[word] = intern_word(other.vocabulary().word(word));
+                posts_with_word[word_ids[word]] += other.num_posts_with_word(word);
+            }
+            if (other.sparse) {
+                for (const auto &entry : other.sparse_posts_with_label_and_word) {
+                    const int label = static_cast<int>(entry.first >> 32);
+                    const int word = static_cast<int>(entry.first & 0xffffffff);
+                    posts_with_label_and_word[cell(label_ids[label], word_ids[word])] += entry.second;
+                }
+            } else {
+                for (int label = 0; label < other.labels().size(); ++label) {
+                    for (int word = 0; word < other.vocabulary().size(); ++word) {
+                        posts_with_label_and_word[cell(label_ids[label], word_ids[word])]
+                            += other.num_posts_with_label_and_word(label, word);
+                    }
+                }
+            }
+            num_training_posts += other.num_training_posts;
+        }
+
+        // MODIFIES: this
+        // EFFECTS: Adds count posts with label.  Together with the two
+        // functions below, this rebuilds counts saved in a model file.
+        void add_label_posts(const string &label, int count) {
+            posts_with_label[intern_label(label)] += count;
+            num_training_posts += count;
+        }
+
+        // MODIFIES: this
+        // EFFECTS: Adds count posts containing word.
+        void add_word_posts(const string &word, int count) {
+            posts_with_word[intern_word(word)] += count;
+        }
+
+        // MODIFIES: this
+        // EFFECTS: Adds count posts with label that contain word.
+        void add_label_word_posts(const string &label, const string &word, int count) {
+            const int label_id = intern_label(label);
+            const int word_id = intern_word(word);
+            if (sparse) {
+                sparse_posts_with_label_and_word[sparse_key(label_id, word_id)] += count;
+            } else {
+                posts_with_label_and_word[cell(label_id, word_id)] += count;
+            }
+        }
+
+        // EFFECTS: Returns the number of posts counted.
+        int num_posts() const {
+            return num_training_posts;
+        }
+
+        // EFFECTS: Returns the words seen in training, by word id.
+        const Vocabulary &vocabulary() const {
+            return words;
+        }
+
+        // EFFECTS: Returns the labels seen in training, by label id.
+        const Vocabulary &labels() const {
+            return label_names;
+        }
+
+        int num_posts_with_word(int word) const {
+            return posts_with_word[word];
+        }
+
+        int num_posts_with_label(int label) const {
+            return posts_with_label[label];
+        }
+
+        int num_posts_with_label_and_word(int label, int word) const {
+            if (sparse) {
+                auto found = sparse_posts_with_label_and_word.find(sparse_key(label, word));
+                return found == sparse_posts_with_label_and_word.end() ? 0 : found->second;
+            }
+            return posts_with_label_and_word[cell(label, word)];
+        }
+
+    private:
+        // EFFECTS: Returns the index of (label, word) in
+        // posts_with_label_and_word.  Computed in size_t, since the table can
+        // hold more than INT_MAX counts.
+        size_t cell(int label, int word) const {
+            return static_cast<size_t>(label) * word_stride + static_cast<size_t>(word);
+        }
+
+        // EFFECTS: Returns the key of (label, word) in
+        // sparse_posts_with_label_and_word.
+        static uint64_t sparse_key(int label, int word) {
+            return static_cast<uint64_t>(label) << 32 | static_cast<uint32_t>(word);
+        }
+
+        // MODIFIES: posts_with_word, posts_with_label_and_word or
+        //           sparse_posts_with_label_and_word
+        // EFFECTS: Counts one post containing word under label.
+        void add_word(int label, int word) {
+            posts_with_word[word]++;
+            if (sparse) {
+                sparse_posts_with_label_and_word[sparse_key(label, word)]++;
+            } else {
+                posts_with_label_and_word[cell(label, word)]++;
+            }
+        }
+
+        // MODIFIES: label_names, posts_with_label, posts_with_label_and_word
+        // EFFECTS: Returns the id of label, adding a zeroed row to the count
+        // tables if label is new.
+        int intern_label(string_view label) {
+            const int label_id = label_names.intern(label);
+            if (label_id == static_cast<int>(posts_with_label.size())) {
+                posts_with_label.push_back(0);
+                if (!sparse) {
+                    posts_with_label_and_word.resize(posts_with_label_and_word.size() + word_stride, 0);
+                }
+            }
+            return label_id;
+        }
+
+        // MODIFIES: words, posts_with_word, posts_with_label_and_word, word_stride
+        // EFFECTS: Returns the id of word.  If word is new, adds a zeroed
+        // column to the count tables, doubling the row stride of
+        // posts_with_label_and_word when it runs out of room.
+        int intern_word(string_view word) {
+            const int word_id = words.intern(word);
+            if (word_id == static_cast<int>(posts_with_word.size())) {
+                posts_with_word.push_back(0);
+                if (!sparse && static_cast<size_t>(word_id) == word_stride) {
+                    const size_t new_stride = max<size_t>(2 * word_stride, 64);
+                    vector<int> counts(static_cast<size_t>(label_names.size()) * new_stride, 0);
+                    for (int label = 0; label < label_names.size(); ++label) {
+                        copy_n(posts_with_label_and_word.begin() + cell(label, 0), word_stride,
+                               counts.begin() + static_cast<size_t>(label) * new_stride);
+                    }
+                    posts_with_label_and_word.swap(counts);
+                    word_stride = new_stride;
+                }
+            }
+            return word_id;
+        }
+
+        int num_training_posts;
+        Vocabulary words;       // by word id
+        Vocabulary label_names; // by label id
+        vector<int> posts_with_word;  // indexed by word id
+        vector<int> posts_with_label; // indexed by label id
+        // Label-major table, the count for (label, word) is stored at
+        // label * word_stride + word.  word_stride grows by doubling.
+        vector<int> posts_with_label_and_word;
+        size_t word_stride;
+        // Whether the (label, word) counts are kept in
+        // sparse_posts_with_label_and_word, keyed by sparse_key(), instead
+        // of in posts_with_label_and_word
+        bool sparse;
+        unordered_map<uint64_t, int> sparse_posts_with_label_and_word;
+        // Reused by add_post() to drop repeated words
+        WordSet post_words;
+        vector<int> post_word_ids;
+};
+
+
+// The log-probabilities a Classifier scores posts with, computed from
+// TrainingCounts.  TrainedModel computes all of them when it is built, and
+// LiveModel computes them as they are needed, both through these functions so
+// that the two always agree.
+
+// EFFECTS: Returns the log-likelihood of words never seen in training.
+static double unseen_log_likelihood(const TrainingCounts &counts) {
+    return log(1 / static_cast<double>(counts.num_posts()));
+}
+
+// REQUIRES: log_priors has score_width >= column_labels.size() entries
+// MODIFIES: log_priors
+// EFFECTS: Sets entry column of log_priors to the log-prior of label
+// column_labels[column].  Padding columns start at -infinity so they never
+// win the argmax.
+static void fill_log_priors(double *log_priors, size_t score_width, const TrainingCounts &counts,
+                            const vector<int> &column_labels) {
+    fill_n(log_priors, score_width, -HUGE_VAL);
+    const double num_posts = counts.num_posts();
+    for (size_t column = 0; column < column_labels.size(); ++column) {
+        log_priors[column] = log(static_cast<double>(counts.num_posts_with_label(column_labels[column])) / num_posts);
+    }
+}
+
+// REQUIRES: log_likelihoods has column_labels.size() entries
+// MODIFIES: log_likelihoods
+// EFFECTS: Sets entry column of log_likelihoods to the log-likelihood of word
+// under label column_labels[column], and returns word's fallback
+// log-likelihood.  Labels a word never appeared with get that fallback.
+static double fill_log_likelihoods(double *log_likelihoods, const TrainingCounts &counts,
+                                   const vector<int> &column_labels, int word) {
+    const double fallback = log(static_cast<double>(counts.num_posts_with_word(word))
+                                / static_cast<double>(counts.num_posts()));
+    for (size_t column = 0; column < column_labels.size(); ++column) {
+        const int label = column_labels[column];
+        const int count = counts.num_posts_with_label_and_word(label, word);
+        log_likelihoods[column] = count > 0
+            ? log(static_cast<double>(count) / static_cast<double>(counts.num_posts_with_label(label)))
+            : fallback;
+    }
+    return fallback;
+}
+
+
+// A bounded first-in first-out queue for handing work from one thread to
+// another.  push() blocks while the queue is full and pop() while it is empty.
+template <typename T>
+class WorkQueue {
+    public:
+        explicit WorkQueue(size_t capacity_in) : capacity(capacity_in), closed(false) {}
+
+        // REQUIRES: close() has not been called
+        // MODIFIES: this
+        // EFFECTS: Waits for room in the queue, then appends item.
+        void push(T item) {
+            unique_lock<mutex> lock(guard);
+            not_full.wait(lock, [this] { return items.size() < capacity; });
+            items.push_back(move(item));
+            not_empty.notify_one();
+        }
+
+        // MODIFIES: this, item
+        // EFFECTS: Waits for an item, moves the oldest one into item and
+        // returns true.  Returns false once the queue is closed and empty.
+        bool pop(T &item) {
+            unique_lock<mutex> lock(guard);
+            not_empty.wait(lock, [this] { return !items.empty() || closed; });
+            if (items.empty()) {
+                return false;
+            }
+            item = move(items.front());
+            items.pop_front();
+            not_full.notify_one();
+            return true;
+        }
+
+        // MODIFIES: this
+        // EFFECTS: Marks the end of the items.  Waiting and future calls to
+        // pop() return false once the remaining items are drained.
+        void close() {
+            lock_guard<mutex> lock(guard);
+            closed = true;
+            not_empty.notify_all();
+        }
+
+    private:
+        mutex guard;
+        condition_variable not_full;
+        condition_variable not_empty;
+        deque<T> items;
+        size_t capacity;
+        bool closed;
+};
+
+
+// Collects items that are finished out of order, each tagged with its
+// position in a sequence, and hands them back in sequence order.  put() blocks
+// while its item is more than window positions ahead of the next one due.
+template <typename T>
+class ReorderBuffer {
+    public:
+        explicit ReorderBuffer(size_t window_in) : window(window_in), next(0), closed(false) {}
+
+        // REQUIRES: no item with this sequence number was put before
+        // MODIFIES: this
+        // EFFECTS: Waits until sequence is within the window, then stores item.
+        void put(size_t sequence, T item) {
+            unique_lock<mutex> lock(guard);
+            taken.wait(lock, [this, sequence] { return sequence < next + window; });
+            items.emplace(sequence, move(item));
+            if (sequence == next) {
+                ready.notify_all();
+            }
+        }
+
+        // MODIFIES: this, item
+        // EFFECTS: Waits for the next item in sequence, moves it into item and
+        // returns true.  Returns false once the buffer is closed and the next
+        // item was never put.
+        bool take(T &item) {
+            unique_lock<mutex> lock(guard);
+            ready.wait(lock, [this] { return items.count(next) || closed; });
+            auto found = items.find(next);
+            if (found == items.end()) {
+                return false;
+            }
+            item = move(found->second);
+            items.erase(found);
+            next += 1;
+            taken.notify_all();
+            return true;
+        }
+
+        // MODIFIES: this
+        // EFFECTS: Marks the end of the items.
+        void close() {
+            lock_guard<mutex> lock(guard);
+            closed = true;
+            ready.notify_all();
+        }
+
+    private:
+        mutex guard;
+        condition_variable ready;
+        condition_variable taken;
+        map<size_t, T> items;
+        size_t window;
+        size_t next;
+        bool closed;
+};
+
+
+// A custom exception type for model files that cannot be read or written
+class ModelError : public std::exception {
+    public:
+        ModelError(const string &msg_in) : msg(msg_in) {}
+        const char *what() const noexcept override {
+            return msg.c_str();
+        }
+
+    private:
+        const string msg;
+};
+
+
+// On-disk layout of a TrainedModel.  The file is a ModelHeader followed by
+// the sections listed in ModelSectionId, each starting on a MODEL_ALIGNMENT
+// byte boundary.  Numbers are stored in the byte order of the machine that
+// wrote the file.  Labels are stored in lexicographic order, one per column of
+// the scoring table, and words in lexicographic order, one per row.
+const char MODEL_MAGIC[8] = {'N', 'B', 'C', 'M', 'O', 'D', 'E', 'L'};
+const uint32_t MODEL_VERSION = 1;
+const size_t MODEL_ALIGNMENT = 64;
+
+enum ModelSectionId {
+    LABEL_OFFSETS,            // uint64_t per label, plus one: where each label starts in LABEL_TEXT
+    LABEL_TEXT,               // label strings, back to back
+    LABEL_COUNTS,             // int32_t per label: number of posts with the label
+    WORD_OFFSETS,             // uint64_t per word, plus one: where each word starts in WORD_TEXT
+    WORD_TEXT,                // word strings, back to back
+    WORD_COUNTS,              // int32_t per word: number of posts with the word
+    WORD_HASH,                // int32_t per slot: open-addressing table of word rows, -1 if empty
+    LOG_PRIORS,               // double per column
+    LOG_LIKELIHOODS,          // double per column per row, with an extra row for unseen words
+    FALLBACK_LOG_LIKELIHOODS, // double per word
+    LABEL_WORD_COUNTS,        // ModelLabelWordCount per nonzero count, sorted by column then word
+    NUM_MODEL_SECTIONS
+};
+
+struct ModelSection {
+    uint64_t offset; // from the start of the file, in bytes
+    uint64_t size;   // in bytes
+};
+
+struct ModelHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t score_width;
+    uint64_t num_training_posts;
+    uint64_t num_labels;
+    uint64_t num_words;
+    uint64_t num_label_word_counts;
+    uint64_t num_hash_slots;
+    double unseen_log_likelihood;
+    ModelSection sections[NUM_MODEL_SECTIONS];
+};
+
+struct ModelLabelWordCount {
+    uint32_t column;
+    uint32_t word;
+    int32_t count;
+};
+
+
+// The frozen scoring table of a trained Classifier.  It is stored in memory
+// exactly as it is laid out in a model file, so a saved model is used straight
+// from a memory mapping of the file, with no parse step.
+class TrainedModel {
+    public:
+        TrainedModel() : base(nullptr), mapping(nullptr), mapping_size(0) {
+            build(TrainingCounts());
+        }
+
+        ~TrainedModel() {
+            unmap();
+        }
+
+        // MODIFIES: this
+        // EFFECTS: Replaces this model with one computed from counts: every
+        // log-probability prediction can need, so that scoring a post is
+        // lookups and additions.
+        void build(const TrainingCounts &counts) {
+            const vector<int> column_labels = counts.labels().sorted_ids();
+            const vector<int> row_words = counts.vocabulary().sorted_ids();
+            const size_t num_labels = column_labels.size();
+            const size_t num_words = row_words.size();
+
+            size_t label_text_size = 0;
+            for (const int label : column_labels) {
+                label_text_size += counts.labels().word(label).size();
+            }
+            size_t word_text_size = 0;
+            size_t num_label_word_counts = 0;
+            for (const int word : row_words) {
+                word_text_size += counts.vocabulary().word(word).size();
+                for (const int label : column_labels) {
+                    num_label_word_counts += counts.num_posts_with_label_and_word(label, word) > 0;
+                }
+            }
+            size_t num_hash_slots = 2;
+            while (num_hash_slots < 2 * num_words) {
+                num_hash_slots *= 2;
+            }
+
+            ModelHeader header;
+            memset(&header, 0, sizeof(header));
+            copy_n(MODEL_MAGIC, sizeof(MODEL_MAGIC), header.magic);
+            header.version = MODEL_VERSION;
+            header.score_width = static_cast<uint32_t>((num_labels + SCORE_LANES - 1) / SCORE_LANES * SCORE_LANES);
+            header.num_training_posts = counts.num_posts();
+            header.num_labels = num_labels;
+            header.num_words = num_words;
+            header.num_label_word_counts = num_label_word_counts;
+            header.num_hash_slots = num_hash_slots;
+            header.unseen_log_likelihood = unseen_log_likelihood(counts);
+            const size_t sizes[NUM_MODEL_SECTIONS] = {
+                (num_labels + 1) * sizeof(uint64_t),
+                label_text_size,
+                num_labels * sizeof(int32_t),
+                (num_words + 1) * sizeof(uint64_t),
+                word_text_size,
+                num_words * sizeof(int32_t),
+                num_hash_slots * sizeof(int32_t),
+                header.score_width * sizeof(double),
+                (num_words + 1) * header.score_width * sizeof(double),
+                num_words * sizeof(double),
+                num_label_word_counts * sizeof(ModelLabelWordCount)
+            };
+            size_t size = align(sizeof(ModelHeader));
+            for (int section = 0; section < NUM_MODEL_SECTIONS; ++section) {
+                header.sections[section] = {size, sizes[section]};
+                size = align(size + sizes[section]);
+            }
+
+            unmap();
+            storage.assign(size / sizeof(uint64_t), 0);
+            base = reinterpret_cast<const char *>(storage.data());
+            size_in_bytes = size;
+            memcpy(storage.data(), &header, sizeof(header));
+
+            uint64_t *label_offsets = writable<uint64_t>(LABEL_OFFSETS);
+            char *label_text = writable<char>(LABEL_TEXT);
+            int32_t *label_counts = writable<int32_t>(LABEL_COUNTS);
+            fill_log_priors(writable<double>(LOG_PRIORS), header.score_width, counts, column_labels);
+            label_offsets[0] = 0;
+            for (size_t column = 0; column < num_labels; ++column) {
+                const string &label = counts.labels().word(column_labels[column]);
+                copy(label.begin(), label.end(), label_text + label_offsets[column]);
+                label_offsets[column + 1] = label_offsets[column] + label.size();
+                label_counts[column] = counts.num_posts_with_label(column_labels[column]);
+            }
+
+            uint64_t *word_offsets = writable<uint64_t>(WORD_OFFSETS);
+            char *word_text = writable<char>(WORD_TEXT);
+            int32_t *word_counts = writable<int32_t>(WORD_COUNTS);
+            int32_t *word_hash = writable<int32_t>(WORD_HASH);
+            double *log_likelihoods = writable<double>(LOG_LIKELIHOODS);
+            double *fallback_log_likelihoods = writable<double>(FALLBACK_LOG_LIKELIHOODS);
+            ModelLabelWordCount *label_word_counts = writable<ModelLabelWordCount>(LABEL_WORD_COUNTS);
+            fill_n(word_hash, num_hash_slots, -1);
+            word_offsets[0] = 0;
+            for (size_t row = 0; row < num_words; ++row) {
+                const string &word = counts.vocabulary().word(row_words[row]);
+                copy(word.begin(), word.end(), word_text + word_offsets[row]);
+                word_offsets[row + 1] = word_offsets[row] + word.size();
+                word_counts[row] = counts.num_posts_with_word(row_words[row]);
+
+                size_t slot = hash_word(word) & (num_hash_slots - 1);
+                while (word_hash[slot] >= 0) {
+                    slot = (slot + 1) & (num_hash_slots - 1);
+                }
+                word_hash[slot] = static_cast<int32_t>(row);
+            }
+
+            for (size_t row = 0; row < num_words; ++row) {
+                fallback_log_likelihoods[row] = fill_log_likelihoods(log_likelihoods + row * header.score_width,
+                                                                     counts, column_labels, row_words[row]);
+            }
+            fill_n(log_likelihoods + num_words * header.score_width, num_labels, header.unseen_log_likelihood);
+
+            for (size_t column = 0; column < num_labels; ++column) {
+                for (size_t row = 0; row < num_words; ++row) {
+                    const int count = counts.num_posts_with_label_and_word(column_labels[column], row_words[row]);
+                    if (count > 0) {
+                        *label_word_counts++ = {static_cast<uint32_t>(column), static_cast<uint32_t>(row), count};
+                    }
+                }
+            }
+        }
+
+        // MODIFIES: this
+        // EFFECTS: Replaces this model with the one saved in filename, mapping
+        // the file into memory where the platform allows.  Throws ModelError
+        // if the file cannot be read or is not a model of this version.
+        void load(const string &filename) {
+            unmap();
+            storage.clear();
+#ifdef MODEL_FILES_MMAP
+            const int fd = open(filename.c_str(), O_RDONLY);
+            struct stat info;
+            if (fd < 0 || fstat(fd, &info) != 0) {
+                if (fd >= 0) {
+                    close(fd);
+                }
+                fail("Error opening model: " + filename);
+            }
+            mapping_size = static_cast<size_t>(info.st_size);
+            mapping = mapping_size > 0 ? mmap(nullptr, mapping_size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+            close(fd);
+            if (mapping == MAP_FAILED) {
+                mapping = nullptr;
+                fail("Error reading model: " + filename);
+            }
+            base = static_cast<const char *>(mapping);
+            size_in_bytes = mapping_size;
+#else
+            ifstream fin(filename, ios::binary | ios::ate);
+            if (!fin) {
+                fail("Error opening model: " + filename);
+            }
+            size_in_bytes = static_cast<size_t>(fin.tellg());
+            storage.assign((size_in_bytes + sizeof(uint64_t) - 1) / sizeof(uint64_t), 0);
+            fin.seekg(0);
+            fin.read(reinterpret_cast<char *>(storage.data()), size_in_bytes);
+            base = reinterpret_cast<const char *>(storage.data());
+#endif
+            if (!valid()) {
+                fail("Not a version " + to_string(MODEL_VERSION) + " model file: " + filename);
+            }
+        }
+
+        // EFFECTS: Writes this model to filename.  Throws ModelError if the
+        // file cannot be written.
+        void save(const string &filename) const {
+            ofstream fout(filename, ios::binary);
+            fout.write(base, size_in_bytes);
+            if (!fout) {
+                throw ModelError("Error writing model: " + filename);
+            }
+        }
+
+        // MODIFIES: counts
+        // EFFECTS: Adds the counts this model was built from to counts.
+        void restore(TrainingCounts &counts) const {
+            for (int column = 0; column < num_labels(); ++column) {
+                counts.add_label_posts(string(label(column)), num_posts_with_label(column));
+            }
+            const int32_t *word_counts = section<int32_t>(WORD_COUNTS);
+            for (int row = 0; row < num_words(); ++row) {
+                counts.add_word_posts(string(word(row)), word_counts[row]);
+            }
+            const ModelLabelWordCount *entries = label_word_counts();
+            for (size_t i = 0; i < num_label_word_counts(); ++i) {
+                counts.add_label_word_posts(string(label(entries[i].column)), string(word(entries[i].word)),
+                                            entries[i].count);
+            }
+        }
+
+        int num_training_posts() const {
+            return static_cast<int>(header().num_training_posts);
+        }
+
+        int num_labels() const {
+            return static_cast<int>(header().num_labels);
+        }
+
+        int num_words() const {
+            return static_cast<int>(header().num_words);
+        }
+
+        // EFFECTS: Returns the number of columns in the scoring table, a
+        // multiple of SCORE_LANES.
+        int score_width() const {
+            return static_cast<int>(header().score_width);
+        }
+
+        // EFFECTS: Returns the label of column, in lexicographic order.
+        string_view label(int column) const {
+            const uint64_t *offsets = section<uint64_t>(LABEL_OFFSETS);
+            return string_view(section<char>(LABEL_TEXT) + offsets[column], offsets[column + 1] - offsets[column]);
+        }
+
+        int num_posts_with_label(int column) const {
+            return section<int32_t>(LABEL_COUNTS)[column];
+        }
+
+        // EFFECTS: Returns the word of row, in lexicographic order.
+        string_view word(int row) const {
+            const uint64_t *offsets = section<uint64_t>(WORD_OFFSETS);
+            return string_view(section<char>(WORD_TEXT) + offsets[row], offsets[row + 1] - offsets[row]);
+        }
+
+        // EFFECTS: Returns the row of word, or unseen_row() if word was never
+        // seen in training.
+        int find_word(string_view word_in) const {
+            const int32_t *word_hash = section<int32_t>(WORD_HASH);
+            const size_t mask = header().num_hash_slots - 1;
+            for (size_t slot = hash_word(word_in) & mask; word_hash[slot] >= 0; slot = (slot + 1) & mask) {
+                if (word(word_hash[slot]) == word_in) {
+                    return word_hash[slot];
+                }
+            }
+            return unseen_row();
+        }
+
+        // EFFECTS: Returns the row holding the log-likelihood of words never
+        // seen in training.
+        int unseen_row() const {
+            return num_words();
+        }
+
+        // EFFECTS: Returns the log-prior of each column.
+        const double *log_priors() const {
+            return section<double>(LOG_PRIORS);
+        }
+
+        // EFFECTS: Returns the word-major table of log-likelihoods, one row of
+        // score_width() columns per word, plus unseen_row().
+        const double *log_likelihoods() const {
+            return section<double>(LOG_LIKELIHOODS);
+        }
+
+        // EFFECTS: Returns the nonzero (label, word) counts, sorted by column
+        // and then by row.
+        const ModelLabelWordCount *label_word_counts() const {
+            return section<ModelLabelWordCount>(LABEL_WORD_COUNTS);
+        }
+
+        size_t num_label_word_counts() const {
+            return header().num_label_word_counts;
+        }
+
+    private:
+        // EFFECTS: Returns size rounded up to a multiple of MODEL_ALIGNMENT.
+        static size_t align(size_t size) {
+            return (size + MODEL_ALIGNMENT - 1) / MODEL_ALIGNMENT * MODEL_ALIGNMENT;
+        }
+
+        const ModelHeader &header() const {
+            return *reinterpret_cast<const ModelHeader *>(base);
+        }
+
+        template <typename T>
+        const T *section(ModelSectionId id) const {
+            return reinterpret_cast<const T *>(base + header().sections[id].offset);
+        }
+
+        template <typename T>
+        T *writable(ModelSectionId id) {
+            return reinterpret_cast<T *>(reinterpret_cast<char *>(storage.data()) + header().sections[id].offset);
+        }
+
+        // EFFECTS: Returns whether the bytes at base are a model of this
+        // version that is safe to use: the magic number and version match,
+        // every section has the size the header implies and lies inside the
+        // file, and every offset, hash slot and index in the sections points
+        // inside what it indexes.
+        bool valid() const {
+            if (size_in_bytes < sizeof(ModelHeader)) {
+                return false;
+            }
+            const ModelHeader &h = header();
+            if (!equal(MODEL_MAGIC, MODEL_MAGIC + sizeof(MODEL_MAGIC), h.magic) || h.version != MODEL_VERSION
+                || h.score_width % SCORE_LANES != 0 || h.score_width < h.num_labels
+                || h.num_hash_slots == 0 || (h.num_hash_slots & (h.num_hash_slots - 1)) != 0
+                || h.num_hash_slots <= h.num_words) {
+                return false;
+            }
+
+            // Counts are checked by division first, so that the section sizes
+            // cannot overflow, and so that rows and columns fit in an int
+            const uint64_t limit = size_in_bytes / sizeof(uint64_t);
+            if (h.num_labels >= limit || h.num_words >= limit || h.num_hash_slots > limit
+                || h.num_label_word_counts > limit || h.num_words >= static_cast<uint64_t>(INT_MAX)
+                || h.score_width > INT_MAX || h.score_width > limit / (h.num_words + 1)) {
+                return false;
+            }
+            const uint64_t sizes[NUM_MODEL_SECTIONS] = {
+                (h.num_labels + 1) * sizeof(uint64_t),
+                h.sections[LABEL_TEXT].size,
+                h.num_labels * sizeof(int32_t),
+                (h.num_words + 1) * sizeof(uint64_t),
+                h.sections[WORD_TEXT].size,
+                h.num_words * sizeof(int32_t),
+                h.num_hash_slots * sizeof(int32_t),
+                h.score_width * sizeof(double),
+                (h.num_words + 1) * h.score_width * sizeof(double),
+                h.num_words * sizeof(double),
+                h.num_label_word_counts * sizeof(ModelLabelWordCount)
+            };
+            for (int id = 0; id < NUM_MODEL_SECTIONS; ++id) {
+                const ModelSection &section = h.sections[id];
+                if (section.size != sizes[id] || section.offset % MODEL_ALIGNMENT != 0
+                    || section.offset > size_in_bytes || section.size > size_in_bytes - section.offset) {
+                    return false;
+                }
+            }
+
+            if (!valid_offsets(section<uint64_t>(LABEL_OFFSETS), h.num_labels, h.sections[LABEL_TEXT].size)
+                || !valid_offsets(section<uint64_t>(WORD_OFFSETS), h.num_words, h.sections[WORD_TEXT].size)) {
+                return false;
+            }
+
+            // find_word() stops at the first empty slot, so there must be one
+            const int32_t *word_hash = section<int32_t>(WORD_HASH);
+            bool any_empty = false;
+            for (uint64_t slot = 0; slot < h.num_hash_slots; ++slot) {
+                if (word_hash[slot] < -1 || static_cast<int64_t>(word_hash[slot]) >= static_cast<int64_t>(h.num_words)) {
+                    return false;
+                }
+                any_empty = any_empty || word_hash[slot] == -1;
+            }
+            if (!any_empty) {
+                return false;
+            }
+
+            const ModelLabelWordCount *entries = label_word_counts();
+            for (uint64_t i = 0; i < h.num_label_word_counts; ++i) {
+                if (entries[i].column >= h.num_labels || entries[i].word >= h.num_words) {
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        // EFFECTS: Returns whether the num + 1 offsets start at 0, never
+        // decrease and end inside a text section of text_size bytes.
+        static bool valid_offsets(const uint64_t *offsets, uint64_t num, uint64_t text_size) {
+            if (offsets[0] != 0 || offsets[num] > text_size) {
+                return false;
+            }
+            for (uint64_t i = 0; i < num; ++i) {
+                if (offsets[i + 1] < offsets[i]) {
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        // MODIFIES: this
+        // EFFECTS: Resets this to an empty model, then throws ModelError(msg).
+        [[noreturn]] void fail(const string &msg) {
+            build(TrainingCounts());
+            throw ModelError(msg);
+        }
+
+        // MODIFIES: this
+        // EFFECTS: Releases the file mapping, if any.
+        void unmap() {
+#ifdef MODEL_FILES_MMAP
+            if (mapping) {
+                munmap(mapping, mapping_size);
+            }
+#endif
+            mapping = nullptr;
+            mapping_size = 0;
+        }
+
+        const char *base;         // start of the model, in storage or mapping
+        size_t size_in_bytes;
+        vector<uint64_t> storage; // backs a model that was built rather than loaded
+        void *mapping;
+        size_t mapping_size;
+
+        // Disable copying, the model may point into a file mapping
+        TrainedModel(const TrainedModel &);
+        TrainedModel &operator=(const TrainedModel &);
+};
+
+
+// A scoring table that follows TrainingCounts as they change after training,
+// laid out like TrainedModel's but indexed by the counts' own ids: row 0 holds
+// the log-likelihood of unseen words and row word + 1 that of word.  Because
+// the total number of posts appears in every prior and fallback, any new post
+// makes every row stale.  Rows are therefore not recomputed when the counts
+// change, only when a post that needs them is scored.
+class LiveModel {
+    public:
+        LiveModel() : num_labels(0), score_width(0), epoch(1), priors_epoch(0) {}
+
+        // REQUIRES: counts are the counts this was last invalidated with,
+        //           with posts added, or this is newly constructed
+        // MODIFIES: this
+        // EFFECTS: Marks every row and the priors stale after counts changed.
+        // New words get new rows.  A new label changes the order of the
+        // columns, so it also drops every row.  Labels are only ever added
+        // to counts, so the label set has changed exactly when its size has.
+        void invalidate(const TrainingCounts &counts) {
+            epoch += 1;
+            if (counts.labels().size() != num_labels) {
+                num_labels = counts.labels().size();
+                column_labels = counts.labels().sorted_ids();
+                score_width = (num_labels + SCORE_LANES - 1) / SCORE_LANES * SCORE_LANES;
+                log_likelihoods.clear();
+                row_epochs.clear();
+            }
+            const size_t num_rows = counts.vocabulary().size() + 1;
+            log_likelihoods.resize(num_rows * score_width, 0);
+            row_epochs.resize(num_rows, 0);
+        }
+
+        // MODIFIES: this
+        // EFFECTS: Brings the priors up to date with counts if they are stale
+        // and returns them, one per column.
+        const double *refresh_log_priors(const TrainingCounts &counts) {
+            if (priors_epoch != epoch) {
+                log_priors.resize(score_width);
+                fill_log_priors(log_priors.data(), score_width, counts, column_labels);
+                priors_epoch = epoch;
+            }
+            return log_priors.data();
+        }
+
+        // MODIFIES: this
+        // EFFECTS: Returns the row of word, bringing it up to date with
+        // counts first if it is stale.
+        int refresh_row(const TrainingCounts &counts, string_view word) {
+            const int word_id = counts.vocabulary().find(word);
+            const int row = word_id + 1;
+            if (row_epochs[row] == epoch) {
+                return row;
+            }
+
+            double *row_log_likelihoods = &log_likelihoods[static_cast<size_t>(row) * score_width];
+            if (word_id < 0) {
+                fill_n(row_log_likelihoods, num_labels, unseen_log_likelihood(counts));
+            } else {
+                fill_log_likelihoods(row_log_likelihoods, counts, column_labels, word_id);
+            }
+            row_epochs[row] = epoch;
+            return row;
+        }
+
+        const double *table() const {
+            return log_likelihoods.data();
+        }
+
+        int width() const {
+            return score_width;
+        }
+
+        int labels() const {
+            return num_labels;
+        }
+
+        // EFFECTS: Returns the label id of column.
+        int column_label(int column) const {
+            return column_labels[column];
+        }
+
+    private:
+        int num_labels;
+        vector<int> column_labels; // label id of each column, in lexicographic order
+        int score_width;
+        vector<double> log_priors;
+        vector<double> log_likelihoods;
+        // A row, or the priors, is up to date when its epoch matches epoch,
+        // which invalidate() advances.
+        vector<uint64_t> row_epochs;
+        uint64_t epoch;
+        uint64_t priors_epoch;
+};
+
+
 class Classifier {
     public:
-        // MODIFIES: debug, num_trainig_posts
-        // EFFECTS: Sets debug to true or false. Initializes the number of trainging posts to be 0.
-        Classifier(const bool enable_debug) : debug(enable_debug), num_training_posts(0) {}
-
-        // MODIFIES: num_posts_with_word, num_posts_with_label, num_posts_with_label_and_word
-        // EFFECTS: Reads in the training posts from train_csv.  Calculates and then stores the training results
-        // in the maps- num_posts_with_word, num_posts_with_label, and num_posts_with_label_and_word.    
-        void train(csvstream &train_csv) {
+        // MODIFIES: debug
+        // EFFECTS: Sets debug to true or false. Starts with no training posts.
+        Classifier(const bool enable_debug)
+            : debug(enable_debug), counts_current(true), model_current(true), online(false) {}
+
+        // REQUIRES: num_threads >= 1
+        // MODIFIES: counts, model
+        // EFFECTS: Reads in the training posts from train_csv, adding them to any posts already counted.  Calculates and then stores the training results
+        // in counts, then freezes them into the model used by prediction().  With more than one thread,
+        // the posts are counted by num_threads workers into private tables that are merged at the end.
+        void train(csvstream &train_csv, const int num_threads = 1) {
             if (debug) {
                 cout << "training data:" << endl;
             }
 
-            map<string, string> post;     
-            while (train_csv >> post) {
-                set<string> words_in_post = unique_words(post["content"]);
-                const string label = post["tag"];
-                auto &words_with_label = num_posts_with_label_and_word[label];
-                for (const string &word : words_in_post) {
-                    num_posts_with_word[word]++;
-                    words_with_label[word]++;
-                }
-                num_posts_with_label[label]++;
-                num_training_posts += 1;
-                
-                if (debug) {
-                    cout << "  label = " << post["tag"] 
-                         << ", content = "<< post["content"] << endl;
-                } 
-            }     
-            
-            cout << "trained on " << num_training_posts << " examples" << endl;
-           
-            if (debug) {    
-                cout << "vocabulary size = " << num_posts_with_word.size() << endl;
+            restore_counts();
+            select_post_columns(train_csv);
+            if (num_threads > 1) {
+                train_sharded(train_csv, num_threads);
+            } else {
+                PostRecord post;     
+                vector<string_view> words;
+                while (train_csv >> post) {
+                    split_words(post.content, words);
+                    counts.add_post(post.tag, words);
+                    
+                    if (debug) {
+                        cout << "  label = " << post.tag 
+                             << ", content = "<< post.content << endl;
+                    } 
+                }     
             }
             
-            cout << endl; // print extra new line  
-            
-            if (debug) {
-                print_classes_and_classifier_parameters();                          
-            }                
+            if (online) {
+                live.invalidate(counts);
+            }
+            freeze();
+            print_training_summary();
+        }
+
+        // MODIFIES: model, counts, live
+        // EFFECTS: Replaces the trained model with the one saved in filename
+        // by save_model(), and prints the same summary train() does.  Throws
+        // ModelError if the file cannot be read.  Anything observed before
+        // is discarded along with the counts.
+        void load_model(const string &filename) {
+            model.load(filename);
+            counts = TrainingCounts();
+            counts_current = false;
+            model_current = true;
+            // The restored counts number their labels afresh, so the live
+            // model's columns must be recomputed from scratch.
+            live = LiveModel();
+            online = false;
+            print_training_summary();
+        }
+
+        // MODIFIES: model
+        // EFFECTS: Saves the trained model, including any posts observed since
+        // training, to filename.  Throws ModelError if the file cannot be
+        // written.
+        void save_model(const string &filename) {
+            sync_model();
+            model.save(filename);
+        }
+
+        // MODIFIES: counts
+        // EFFECTS: Learns from one more labeled post without retraining.  The
+        // log-probabilities that depend on the post are recomputed lazily, the
+        // next time predict() needs them, and prediction() refreezes the model
+        // first.  Must not be called while another thread uses this Classifier.
+        void observe(const string &label, const string &content) {
+            begin_observing();
+            split_words(content, live_scratch.words);
+            counts.add_post(label, live_scratch.words);
+            live.invalidate(counts);
+        }
+
+        // MODIFIES: counts
+        // EFFECTS: Learns from each (label, content) pair in posts, as if by
+        // observe(), invalidating the log-probabilities once for the batch.
+        void observe_batch(const vector<pair<string, string>> &posts) {
+            begin_observing();
+            for (const auto &post : posts) {
+                split_words(post.second, live_scratch.words);
+                counts.add_post(post.first, live_scratch.words);
+            }
+            live.invalidate(counts);
+        }
+
+        // MODIFIES: this
+        // EFFECTS: Returns the label predicted for a post with the given
+        // content and stores its log-prob score in best_log_prob_score, the
+        // same result prediction() gives.  After observe(), recomputes only
+        // the priors and the rows of the post's own words that are stale.
+        // Returns "" and sets the score to 0 if there are no labels.
+        string predict(const string &content, double &best_log_prob_score) {
+            if (!online) {
+                const int best_column = classify(content, live_scratch, best_log_prob_score);
+                return best_column < 0 ? string() : string(model.label(best_column));
+            }
+
+            unique_words(content, live_scratch.words, live_scratch.seen_words);
+            live_scratch.word_ids.clear();
+            for (const string_view word : live_scratch.words) {
+                live_scratch.word_ids.push_back(live.refresh_row(counts, word));
+            }
+            const int best_column = score_rows(live.refresh_log_priors(counts), live.table(), live.width(),
+                                               live.labels(), live_scratch, best_log_prob_score);
+            return best_column < 0 ? string() : counts.labels().word(live.column_label(best_column));
         }
 
+        // REQUIRES: num_threads >= 1
         // EFFECTS: Reads in the testing posts from test_csv.  Calculates a
         // log-probability score for each of the possible labels for a given post.
         // Predicts the label with the highest log-prob score for each post.   
-        void prediction(csvstream &test_csv) { 
+        // With more than one thread, posts are scored by num_threads workers
+        // and printed in input order, so the output is the same either way.
+        void prediction(csvstream &test_csv, const int num_threads = 1) { 
+            sync_model();
             cout << "test data:" << endl;
             
-            map<string, string> post;
             int num_testing_posts = 0;
             int num_correct_posts = 0;
-            bool first_log_prob_score = true;
-            double best_log_prob_score = 0;
-            string best_log_prob_label; 
-            while (test_csv >> post)  {
-                num_testing_posts += 1;
-                first_log_prob_score = true;
-                best_log_prob_score = 0;
-                best_log_prob_label = "";
-                for (const auto &label : num_posts_with_label) {
-                    double log_prob_score = log(static_cast<double>(label.second) 
-                                                 / static_cast<double>(num_training_posts));
-                    
-                    set<string> post_words = unique_words(post["content"]);
-                    for (const string &word : post_words) {
-                        log_prob_score += calculate_log_likelihood(label.first, word);
-                    }
-                    
-                    if (first_log_prob_score) {
-                        best_log_prob_score = log_prob_score;
-                        best_log_prob_label = label.first;
-                        first_log_prob_score = false;
-                    } else {
-                        max_log_prob_score(best_log_prob_score, best_log_prob_label, log_prob_score, label.first);
+            select_post_columns(test_csv);
+            if (num_threads > 1) {
+                predict_parallel(test_csv, num_threads, num_testing_posts, num_correct_posts);
+            } else {
+                PostRecord post;
+                ScoringScratch scratch;
+                while (test_csv >> post)  {
+                    num_testing_posts += 1;
+                    if (predict_post(cout, post.tag, post.content, scratch)) {
+                        num_correct_posts += 1;
                     }
                 }
-
-                cout << "  correct = " << post["tag"] << ", predicted = " << best_log_prob_label
-                     << ", log-probability score = " << best_log_prob_score << endl
-                     << "  content = " << post["content"] << endl << endl;
-                if (best_log_prob_label == post["tag"]) {
-                    num_correct_posts += 1;
-                }
             }
 
             cout << "performance: " << num_correct_posts << " / " << num_testing_posts << " posts predicted correctly" << endl;                 
         }
     
     private:
-        // EFFECTS: Returns a set of unique whitespace delimited words.x
-        set<string> unique_words(const string &str) {
-          istringstream source(str);
-          set<string> words;
-          string word;
-          while (source >> word) {
-            words.insert(word);
-          }
-          return words;
+        // The columns of a CSV file that the Classifier reads.  A PostRecord
+        // read after select_post_columns() has them in its members, and a
+        // csvrow read in chunks is decoded into a Post by PostRecord::decode().
+        struct Post {
+            string_view tag;
+            string_view content;
+        };
+        using PostRecord = csvrecord<Post, &Post::tag, &Post::content>;
+
+        // MODIFIES: csv
+        // EFFECTS: Makes csv read only the tag and content of each post, in
+        // the order of the members of a PostRecord.  Throws
+        // csvstream_exception if either column is missing.
+        static void select_post_columns(csvstream &csv) {
+            csv.select_columns({"tag", "content"});
+        }
+
+        // The CSV files read by train_sharded() are parsed in chunks of about
+        // this many bytes, and each chunk's posts are handed to a worker as one
+        // batch of rows.
+        static const size_t TRAINING_CHUNK_SIZE = 1 << 18;
+        using PostBatch = vector<csvrow>;
+
+        // REQUIRES: num_threads > 1
+        // MODIFIES: counts
+        // EFFECTS: Parses train_csv in chunks on num_threads threads, and deals
+        // the chunks out on this thread, in file order and round robin, to
+        // num_threads workers.  Each worker
+        // tokenizes and counts its posts into its own TrainingCounts.  The
+        // worker tables are merged into counts in worker order once every
+        // post is counted, so the result does not depend on thread timing.
+        void train_sharded(csvstream &train_csv, const int num_threads) {
+            vector<TrainingCounts> shards;
+            shards.reserve(num_threads);
+            for (int i = 0; i < num_threads; ++i) {
+                shards.emplace_back(true);
+            }
+            vector<unique_ptr<WorkQueue<PostBatch>>> queues;
+            vector<thread> workers;
+            for (int i = 0; i < num_threads; ++i) {
+                queues.emplace_back(new WorkQueue<PostBatch>(2));
+            }
+            for (int i = 0; i < num_threads; ++i) {
+                workers.emplace_back([&shards, &queues, i] {
+                    PostBatch batch;
+                    Post post;
+                    vector<string_view> words;
+                    while (queues[i]->pop(batch)) {
+                        for (const csvrow &row : batch) {
+                            PostRecord::decode(row, post);
+                            split_words(post.content, words);
+                            shards[i].add_post(post.tag, words);
+                        }
+                    }
+                });
+            }
+
+            // Stop the workers even if reading the CSV throws.
+            auto finish = [&queues, &workers] {
+                for (auto &queue : queues) {
+                    queue->close();
+                }
+                for (thread &worker : workers) {
+                    worker.join();
+                }
+            };
+
+            try {
+                size_t next_worker = 0;
+                auto deal = [this, &queues, &next_worker, num_threads](size_t, vector<csvrow> &rows) {
+                    if (debug) {
+                        Post post;
+                        for (const csvrow &row : rows) {
+                            PostRecord::decode(row, post);
+                            cout << "  label = " << post.tag
+                                 << ", content = "<< post.content << endl;
+                        }
+                    }
+                    // The rows move to the worker, so they are never copied.
+                    PostBatch batch;
+                    batch.swap(rows);
+                    queues[next_worker]->push(move(batch));
+                    next_worker = (next_worker + 1) % num_threads;
+                };
+                train_csv.read_parallel(num_threads, true, deal, TRAINING_CHUNK_SIZE);
+            } catch (...) {
+                finish();
+                throw;
+            }
+            finish();
+
+            for (const TrainingCounts &shard : shards) {
+                counts.merge(shard);
+            }
+        }
+
+        // Buffers reused by classify() from one post to the next.
+        struct ScoringScratch {
+            vector<string_view> words; // the post's unique words
+            WordSet seen_words; // the words of a short post seen so far
+            vector<string_view> unseen_words; // the words of a long post not in the model
+            vector<int> word_ids; // scoring table row of each of the post's unique words
+            vector<double> scores; // running log-probability score of each table column
+        };
+
+        // The CSV files read by predict_parallel() are parsed in chunks of
+        // about this many bytes, each chunk's posts are scored as one batch,
+        // and at most PREDICTION_WINDOW batches are in flight at once.
+        static const size_t PREDICTION_CHUNK_SIZE = 1 << 16;
+        static const size_t PREDICTION_WINDOW = 64;
+
+        struct NumberedBatch {
+            size_t sequence; // position of the batch in the input
+            PostBatch posts;
+        };
+
+        struct PredictedBatch {
+            string output;    // what the serial prediction() prints for the batch
+            int num_correct;
+        };
+
+        // REQUIRES: num_threads > 1
+        // MODIFIES: num_testing_posts, num_correct_posts
+        // EFFECTS: Parses test_csv in chunks on num_threads threads, and hands
+        // each chunk's posts out as a numbered batch to num_threads workers,
+        // which score them
+        // against the trained model and format the output into strings.  A
+        // writer thread reorders the finished batches and prints them in input
+        // order.  Each worker counts its own correct predictions, and the
+        // counts are added up once the workers finish.
+        void predict_parallel(csvstream &test_csv, const int num_threads,
+                              int &num_testing_posts, int &num_correct_posts) const {
+            WorkQueue<NumberedBatch> batches(2 * num_threads);
+            ReorderBuffer<PredictedBatch> predictions(PREDICTION_WINDOW);
+            vector<int> num_correct(num_threads, 0);
+            vector<thread> workers;
+            for (int i = 0; i < num_threads; ++i) {
+                workers.emplace_back([this, &batches, &predictions, &num_correct, i] {
+                    ScoringScratch scratch;
+                    NumberedBatch batch;
+                    while (batches.pop(batch)) {
+                        ostringstream output;
+                        output.copyfmt(cout);
+                        PredictedBatch predicted{string(), 0};
+                        Post post;
+                        for (const csvrow &row : batch.posts) {
+                            PostRecord::decode(row, post);
+                            if (predict_post(output, post.tag, post.content, scratch)) {
+                                predicted.num_correct += 1;
+                            }
+                        }
+                        predicted.output = output.str();
+                        num_correct[i] += predicted.num_correct;
+                        predictions.put(batch.sequence, move(predicted));
+                    }
+                });
+            }
+            thread writer([&predictions] {
+                PredictedBatch predicted;
+                while (predictions.take(predicted)) {
+                    cout << predicted.output;
+                }
+            });
+
+            // Stop the workers and the writer even if reading the CSV throws.
+            auto finish = [&batches, &predictions, &workers, &writer] {
+                batches.close();
+                for (thread &worker : workers) {
+                    worker.join();
+                }
+                predictions.close();
+                writer.join();
+            };
+
+            try {
+                // Chunks arrive in file order, numbered from 0.
+                auto hand_out = [&batches, &num_testing_posts](size_t chunk, vector<csvrow> &rows) {
+                    num_testing_posts += static_cast<int>(rows.size());
+                    NumberedBatch batch{chunk, PostBatch()};
+                    batch.posts.swap(rows);
+                    batches.push(move(batch));
+                };
+                test_csv.read_parallel(num_threads, true, hand_out, PREDICTION_CHUNK_SIZE);
+            } catch (...) {
+                finish();
+                throw;
+            }
+            finish();
+
+            for (const int correct : num_correct) {
+                num_correct_posts += correct;
+            }
+        }
+
+        // MODIFIES: os, scratch
+        // EFFECTS: Predicts the label of one test post and prints the result to
+        // os.  Returns whether the prediction matches the correct label.
+        bool predict_post(ostream &os, string_view correct_label, string_view content,
+                          ScoringScratch &scratch) const {
+            double best_log_prob_score = 0;
+            const int best_column = classify(content, scratch, best_log_prob_score);
+            const string_view best_log_prob_label = best_column < 0 ? string_view() : model.label(best_column);
+
+            os << "  correct = " << correct_label << ", predicted = " << best_log_prob_label
+               << ", log-probability score = " << best_log_prob_score << endl
+               << "  content = " << content << endl << endl;
+            return best_log_prob_label == correct_label;
+        }
+
+        // REQUIRES: freeze() has been called since the last change to the counts
+        // MODIFIES: scratch, best_log_prob_score
+        // EFFECTS: Tokenizes content once and scores it against every label in a
+        // single pass over its words.  Returns the model column of the label with
+        // the highest log-prob score and stores that score in best_log_prob_score.
+        // Ties go to the label that is greater in lexicographic order.  Returns
+        // -1 and sets the score to 0 if there are no labels.
+        int classify(string_view content, ScoringScratch &scratch, double &best_log_prob_score) const {
+            split_words(content, scratch.words);
+            if (scratch.words.size() > SMALL_POST_WORDS) {
+                find_unique_rows(scratch);
+            } else {
+                sort_unique_words(scratch.words, scratch.seen_words);
+                scratch.word_ids.clear();
+                for (const string_view word : scratch.words) {
+                    scratch.word_ids.push_back(model.find_word(word));
+                }
+            }
+            return score_rows(model.log_priors(), model.log_likelihoods(), model.score_width(), model.num_labels(),
+                              scratch, best_log_prob_score);
+        }
+
+        // REQUIRES: scratch.word_ids holds the rows of a post's unique words in
+        //           lexicographic order of the words
+        // MODIFIES: scratch, best_log_prob_score
+        // EFFECTS: Adds up the log-prior and the rows of a scoring table for
+        // every column, then returns the best column and stores its score in
+        // best_log_prob_score, as classify() describes.
+        static int score_rows(const double *log_priors, const double *log_likelihoods, const int score_width,
+                              const int num_labels, ScoringScratch &scratch, double &best_log_prob_score) {
+            // Words are added in the same order for every label, and in the
+            // same order as the per-label sum they replace, so scores match it
+            // exactly.
+            scratch.scores.assign(log_priors, log_priors + score_width);
+            score_kernels.add_score_rows(scratch.scores.data(), log_likelihoods, scratch.word_ids.data(),
+                                         scratch.word_ids.size(), score_width);
+
+            best_log_prob_score = 0;
+            if (num_labels == 0) {
+                return -1;
+            }
+            const int best_column = score_kernels.max_score_index(scratch.scores.data(), score_width);
+            best_log_prob_score = scratch.scores[best_column];
+            return best_column;
+        }
+
+        // REQUIRES: scratch.words holds the words of a post
+        // MODIFIES: scratch
+        // EFFECTS: Sets scratch.word_ids to the model rows of the post's unique
+        // words, in lexicographic order of the words.  Known rows are numbered
+        // in that order already, so they are sorted as integers, and only the
+        // words missing from the model are compared as strings.
+        void find_unique_rows(ScoringScratch &scratch) const {
+            const int unseen_row = model.unseen_row();
+            scratch.word_ids.clear();
+            scratch.unseen_words.clear();
+            for (const string_view word : scratch.words) {
+                const int row = model.find_word(word);
+                if (row == unseen_row) {
+                    scratch.unseen_words.push_back(word);
+                } else {
+                    scratch.word_ids.push_back(row);
+                }
+            }
+            vector<int> &rows = scratch.word_ids;
+            vector<string_view> &unseen = scratch.unseen_words;
+            sort(rows.begin(), rows.end());
+            rows.erase(unique(rows.begin(), rows.end()), rows.end());
+            sort(unseen.begin(), unseen.end());
+            unseen.erase(unique(unseen.begin(), unseen.end()), unseen.end());
+
+            // Merge the unseen words in from the back, so that no row is
+            // overwritten before it is moved.
+            size_t num_rows = rows.size();
+            size_t num_unseen = unseen.size();
+            rows.resize(num_rows + num_unseen);
+            for (size_t next = rows.size(); num_unseen > 0; ) {
+                if (num_rows > 0 && unseen[num_unseen - 1] < model.word(rows[num_rows - 1])) {
+                    rows[--next] = rows[--num_rows];
+                } else {
+                    rows[--next] = unseen_row;
+                    --num_unseen;
+                }
+            }
+        }
+
+        // MODIFIES: words, seen
+        // EFFECTS: Replaces words with the unique whitespace delimited words of
+        // content, in lexicographic order.  The words are views into content,
+        // and words keeps its capacity from one post to the next.
+        static void unique_words(string_view content, vector<string_view> &words, WordSet &seen) {
+            split_words(content, words);
+            sort_unique_words(words, seen);
+        }
+
+        // MODIFIES: model
+        // EFFECTS: Precomputes every log-probability prediction() can need from
+        // the training counts, so that scoring a post is lookups and additions.
+        void freeze() {
+            model.build(counts);
+            model_current = true;
+        }
+
+        // MODIFIES: model
+        // EFFECTS: Refreezes the model if posts were observed since it was
+        // last frozen.
+        void sync_model() {
+            if (!model_current) {
+                freeze();
+            }
+        }
+
+        // MODIFIES: counts
+        // EFFECTS: Restores the counts of a model loaded from a file, so that
+        // more posts can be added to them.
+        void restore_counts() {
+            if (!counts_current) {
+                model.restore(counts);
+                counts_current = true;
+            }
+        }
+
+        // MODIFIES: counts, live, online
+        // EFFECTS: Prepares to update the counts online.  A model loaded from
+        // a file has its counts restored from the file first.
+        void begin_observing() {
+            restore_counts();
+            if (!online) {
+                live.invalidate(counts);
+                online = true;
+            }
+            model_current = false;
+        }
+
+        void print_training_summary() {
+            cout << "trained on " << model.num_training_posts() << " examples" << endl;
+           
+            if (debug) {    
+                cout << "vocabulary size = " << model.num_words() << endl;
+            }
+            
+            cout << endl; // print extra new line  
+            
+            if (debug) {
+                print_classes_and_classifier_parameters();                          
+            }                
         }
 
         void print_classes_and_classifier_parameters() {
             cout << "classes:" << endl;
-               for (const auto &label : num_posts_with_label) {
-                   const double num_labels = label.second;
-                   const double log_prior = log(num_labels / static_cast<double>(num_training_posts));
-                   cout << "  " << label.first << ", " << num_labels << " examples, log-prior = " 
+               for (int column = 0; column < model.num_labels(); ++column) {
+                   const double num_labels = model.num_posts_with_label(column);
+                   const double log_prior = model.log_priors()[column];
+                   cout << "  " << model.label(column) << ", " << num_labels << " examples, log-prior = " 
                         << log_prior << endl;
                }
                
                cout << "classifier parameters:" << endl;
-               for (const auto &label : num_posts_with_label) {
-                   for (const auto &word : num_posts_with_word) {                      
-                       if (num_posts_with_label_and_word[label.first].find(word.first) != num_posts_with_label_and_word[label.first].end()) {
-                           const double num_labels_and_words = num_posts_with_label_and_word[label.first][word.first];
-                           const double log_likelihood = log(num_labels_and_words / static_cast<double>(num_posts_with_label[label.first]));
-                           cout << "  " << label.first << ":" << word.first << ", count = " << num_labels_and_words
-                            << ", log-likelihood = " << log_likelihood << endl;            
-                       }    
-                   }
+               const ModelLabelWordCount *label_word_counts = model.label_word_counts();
+               for (size_t i = 0; i < model.num_label_word_counts(); ++i) {
+                   const ModelLabelWordCount &entry = label_word_counts[i];
+                   const double num_labels_and_words = entry.count;
+                   const double log_likelihood = model.log_likelihoods()[static_cast<size_t>(entry.word) * model.score_width() + entry.column];
+                   cout << "  " << model.label(entry.column) << ":" << model.word(entry.word) << ", count = " << num_labels_and_words
+                    << ", log-likelihood = " << log_likelihood << endl;            
                }
                cout << endl; // print extra new line    
         }
 
-        // EFFECTS: Returns the log-likelihood of word.
-        double calculate_log_likelihood(const string &label, const string &word) {
-            if (num_posts_with_label_and_word[label].find(word) != num_posts_with_label_and_word[label].end()) {
-                return log(static_cast<double>(num_posts_with_label_and_word[label][word]) 
-                                                  / static_cast<double>(num_posts_with_label[label]));                           
-            } else if (num_posts_with_word.find(word) != num_posts_with_word.end()) {
-                return log(static_cast<double>(num_posts_with_word[word]) 
-                                                  / static_cast<double>(num_training_posts));                            
-            } else {
-                return log(1 / static_cast<double>(num_training_posts));                          
-            }
-        }
-
-        // EFFECTS: Sets best_log_prob_score and best_log_prob_label as the max log prob score and corresponding label.
-        void max_log_prob_score(double &best_log_prob_score, string &best_log_prob_label, const double log_prob_score, const string &label) {
-            if (log_prob_score > best_log_prob_score) {
-                best_log_prob_score = log_prob_score;
-                best_log_prob_label = label;    
-            } else if (log_prob_score == best_log_prob_score) {
-                if (label > best_log_prob_label) {
-                    best_log_prob_score = log_prob_score;
-                    best_log_prob_label = label; 
-                }
-            }    
-        }
-
         bool debug; // print debug output
-        int num_training_posts;
-        map<string, int> num_posts_with_word;
-        map<string, int> num_posts_with_label;  
-        map<string, map<string, int>> num_posts_with_label_and_word;          
+        TrainingCounts counts;
+        TrainedModel model; // scoring table built by freeze() or loaded from a file
+        bool counts_current; // false when model was loaded and counts not yet restored
+        bool model_current;  // false when posts were observed since the last freeze()
+        bool online;         // true once observe() has been called
+        LiveModel live;      // scores predict() once online
+        ScoringScratch live_scratch;
 };
  
+// Classifier_tests.cpp includes this file with CLASSIFIER_NO_MAIN defined, so
+// that it can test the Classifier without this main().
+#ifndef CLASSIFIER_NO_MAIN
 int main(int argc, char *argv[]) { 
     cout.precision(3);    
     
-    if (!(argc == 3 || argc == 4)) {
-        cout << "Usage: main.exe TRAIN_FILE TEST_FILE [--debug]" << endl;
+    const string usage = "Usage: main.exe TRAIN_FILE TEST_FILE [--debug] [--threads N] [--cache] [--save-model MODEL_FILE]\n"
+                         "       main.exe --load-model MODEL_FILE TEST_FILE [--debug] [--threads N] [--cache]";
+    if (argc < 3) {
+        cout << usage << endl;
         return 1;         
     }
 
+    // With --load-model, the model file takes the place of the training file.
+    const bool load_model = string(argv[1]) == "--load-model";
+    const int first_option = load_model ? 4 : 3;
+    if (argc < first_option) {
+        cout << usage << endl;
+        return 1;
+    }
+    const string train_file = argv[first_option - 2];
+    const string test_file = argv[first_option - 1];
+
+    bool debug = false;
+    int num_threads = 1;
+    unsigned csv_flags = CSVSTREAM_READ_AHEAD | CSVSTREAM_PARALLEL_DECODE;
+    string save_model_file;
+    for (int i = first_option; i < argc; ++i) {
+        const string arg = argv[i];
+        if (arg == "--debug") {
+            debug = true;
+        } else if (arg == "--threads" && i + 1 < argc && atoi(argv[i + 1]) >= 1) {
+            num_threads = atoi(argv[++i]);
+        } else if (arg == "--cache") {
+            csv_flags |= CSVSTREAM_CACHE;
+        } else if (arg == "--save-model" && !load_model && i + 1 < argc) {
+            save_model_file = argv[++i];
+        } else {
+            cout << usage << endl;
+            return 1;
+        }
+    }
+
     try {
-        csvstream train_csv(argv[1]);
-        csvstream test_csv(argv[2]);
-        bool debug = false;
-        if (argc == 4) { // debug
-            string debug_arg = argv[3];
-            if (debug_arg != "--debug") {
-                cout << "Usage: main.exe TRAIN_FILE TEST_FILE [--debug]" << endl; 
-                return 1;        
-            } 
-            debug = true;     
-        }
-        
+        // Files that cannot be memory-mapped, such as pipes, are read ahead
+        // of the parser on a background thread.  Compressed files are
+        // decompressed as they are parsed when built with CSVSTREAM_ZLIB or
+        // CSVSTREAM_ZSTD.  With --cache, parsed files are saved next to them
+        // and read back on later runs.
+        unique_ptr<csvstream> train_csv(load_model ? nullptr :
+                                        new csvstream(train_file, ',', true, csv_flags));
+        csvstream test_csv(test_file, ',', true, csv_flags);
+
         Classifier classifier(debug);
-        classifier.train(train_csv);
-        classifier.prediction(test_csv);
+        if (load_model) {
+            classifier.load_model(train_file);
+        } else {
+            classifier.train(*train_csv, num_threads);
+            if (!save_model_file.empty()) {
+                classifier.save_model(save_model_file);
+            }
+        }
+        classifier.prediction(test_csv, num_threads);
 
     } catch (csvstream_exception &e) {
-        cout << "Error opening file: " << argv[1] << endl;
+        // The message names the file that failed and what was wrong with it.
+        cout << e.what() << endl;
+        return 1;
+    } catch (ModelError &e) {
+        cout << e.what() << endl;
         return 1;
     }
   
     return 0;
 }
+#endif
 